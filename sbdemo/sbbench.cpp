@@ -0,0 +1,213 @@
+/*
+** Headless benchmark of the painters used by the "Free Span Buffer" demo.
+** A seeded set of bouncing sprites is rendered into an offscreen image for a
+** number of frames, and the frame latency, the number of pixels written and
+** the overdraw ratio are reported for every painter. FS-Buf skips the
+** sprites it finds fully covered, unless --noskip is given.
+*/
+#include "sbuffer.h"
+#include <memory>
+#include <random>
+
+struct Config {
+   QSize size;
+   int sprites;
+   qreal scale;
+};
+
+struct Result {
+   std::vector<qint64> ns;    // per-frame latency
+   qint64 written = 0;        // pixels written over all frames
+   qint64 covered = 0;        // sprite pixels inside the target over all frames
+   qint64 skipped = 0;        // sprites found fully covered over all frames
+};
+
+static QVector<int> toInts(const QString &list) {
+   QVector<int> r;
+   for (auto &s : list.split(',', QString::SkipEmptyParts))
+      r.push_back(s.toInt());
+   return r;
+}
+
+static QVector<qreal> toReals(const QString &list) {
+   QVector<qreal> r;
+   for (auto &s : list.split(',', QString::SkipEmptyParts))
+      r.push_back(s.toDouble());
+   return r;
+}
+
+static QVector<QSize> toSizes(const QString &list) {
+   QVector<QSize> r;
+   for (auto &s : list.split(',', QString::SkipEmptyParts)) {
+      auto wh = s.split('x');
+      if (wh.size() == 2)
+         r.push_back({wh[0].toInt(), wh[1].toInt()});
+   }
+   return r;
+}
+
+static QVector<State> seededState(int count, const QSize &size, quint32 seed) {
+   std::mt19937 gen(seed);
+   std::uniform_int_distribution<int> x(0, size.width()-1), y(0, size.height()-1), v(-1024, 1023);
+   QVector<State> state(count);
+   for (auto &s : state) {
+      s.pos = QPointF(x(gen), y(gen));
+      s.vel = {v(gen)/256.0, v(gen)/256.0};
+   }
+   return state;
+}
+
+template <typename T>
+static ImagePainter *newZBufPainter(const QImage &src, QImage &dst, int sprites, ZKernel::Isa isa,
+                                    bool tiled) {
+   if (sprites > BasicZBufPainter<T>::maxDraws())
+      return nullptr;
+   auto *const painter = new BasicZBufPainter<T>{src, dst, tiled};
+   painter->setIsa(isa);
+   return painter;
+}
+
+static qint64 percentile(const std::vector<qint64> &sorted, int pct) {
+   if (sorted.empty())
+      return 0;
+   auto const i = std::min(sorted.size()-1, size_t((sorted.size() * pct + 99) / 100) - 1);
+   return sorted[i];
+}
+
+// the sprites fully covered are skipped when spans is the painter
+static Result run(ImagePainter &painter, const FreeSpanDraw *spans, const QImage &sprite, QImage &dst,
+                  const Config &cfg, int frames, int warmup, quint32 seed) {
+   Result r;
+   qint64 skipped = 0;
+   auto state = seededState(cfg.sprites, dst.size(), seed);
+   QElapsedTimer el;
+   for (int f = -warmup; f < frames; ++f) {
+      for (auto &s : state)
+         s.advance(1, dst.rect());
+      auto const written = painter.pixelsWritten();
+      el.start();
+      painter.begin();
+      skipped = 0;
+      for (auto &s : state)
+         if (spans && spans->isFullyCovered(s.pos.toPoint()))
+            skipped++;
+         else
+            painter.draw(s.pos.toPoint());
+      painter.end();
+      auto const ns = el.nsecsElapsed();
+      if (f < 0)
+         continue;
+      r.ns.push_back(ns);
+      r.written += painter.pixelsWritten() - written;
+      r.skipped += skipped;
+      for (auto &s : state) {
+         auto const p = s.pos.toPoint() - sprite.rect().center();
+         auto const rect = QRect(p, sprite.size()).intersected(dst.rect());
+         r.covered += qint64(rect.width()) * rect.height();
+      }
+   }
+   std::sort(r.ns.begin(), r.ns.end());
+   return r;
+}
+
+int main(int argc, char *argv[])
+{
+   QCoreApplication app(argc, argv);
+   QCommandLineParser parser;
+   parser.setApplicationDescription("Headless benchmark of the sbdemo painters");
+   parser.addHelpOption();
+   QCommandLineOption framesOpt({"f", "frames"}, "Measured frames per run.", "n", "200");
+   QCommandLineOption warmupOpt({"w", "warmup"}, "Unmeasured frames per run.", "n", "10");
+   QCommandLineOption resOpt({"r", "resolution"}, "Target sizes, e.g. 640x400,1920x1080.", "list", "640x400");
+   QCommandLineOption spritesOpt({"n", "sprites"}, "Sprite counts.", "list", "10,50,200");
+   QCommandLineOption depthOpt({"d", "depth"}, "Overlap densities (average sprites covering a pixel); "
+                                               "overrides --sprites.", "list");
+   QCommandLineOption scaleOpt({"s", "scale"}, "Sprite scale factors.", "list", "2");
+   QCommandLineOption seedOpt("seed", "Random seed for the sprite positions.", "n", "1");
+   QCommandLineOption paintersOpt({"p", "painters"}, "Painters to run: 1=Painter 2=Z-Buf 3=FS-Buf.", "list", "1,2,3");
+   QCommandLineOption zdepthOpt("zdepth", "Z-Buf depth type: 8, 16 or float.", "type", "8");
+   QCommandLineOption zkernelOpt("zkernel", "Z-Buf row kernel: scalar, sse4.1 or avx2; "
+                                            "the best the CPU runs by default.", "isa");
+   QCommandLineOption zflatOpt("zflat", "Z-Buf without the per-tile depth bounds.");
+   QCommandLineOption bandsOpt({"b", "bands"}, "Render in that many horizontal bands on a thread pool; "
+                                               "0 renders on the calling thread.", "n", "0");
+   QCommandLineOption noskipOpt("noskip", "FS-Buf draws the sprites that are fully covered too.");
+   parser.addOptions({framesOpt, warmupOpt, resOpt, spritesOpt, depthOpt, scaleOpt, seedOpt, paintersOpt,
+                      zdepthOpt, zkernelOpt, zflatOpt, bandsOpt, noskipOpt});
+   parser.process(app);
+
+   int const frames = std::max(1, parser.value(framesOpt).toInt());
+   int const warmup = std::max(0, parser.value(warmupOpt).toInt());
+   quint32 const seed = parser.value(seedOpt).toUInt();
+   auto const painters = toInts(parser.value(paintersOpt));
+   auto const depths = toReals(parser.value(depthOpt));
+   auto const zdepth = parser.value(zdepthOpt);
+   bool const ztiled = !parser.isSet(zflatOpt);
+   int const bands = std::max(0, parser.value(bandsOpt).toInt());
+   bool const skip = !parser.isSet(noskipOpt);
+   auto isa = ZKernel::bestIsa();
+   for (auto i : {ZKernel::Scalar, ZKernel::SSE41, ZKernel::AVX2})
+      if (parser.value(zkernelOpt) == ZKernel::isaName(i))
+         isa = std::min(i, isa);
+
+   QImage const src = QImage(":/monkey.bmp").convertToFormat(QImage::Format_ARGB32_Premultiplied);
+   if (src.isNull()) {
+      fprintf(stderr, "Unable to load the sprite image\n");
+      return 1;
+   }
+
+   printf("Z-Buf: %s depth, %s kernel, %s; %d bands\n", qPrintable(zdepth), ZKernel::isaName(isa),
+          ztiled ? "tiled" : "flat", bands);
+   printf("%-8s %11s %7s %5s %6s %9s %9s %9s %9s %11s %8s %8s\n", "painter", "resolution", "sprites",
+          "scale", "depth", "p50 ms", "p90 ms", "p99 ms", "max ms", "px/frame", "overdraw", "skipped");
+   for (auto const &size : toSizes(parser.value(resOpt)))
+      for (auto const scale : toReals(parser.value(scaleOpt))) {
+         QImage const image = src.scaled(src.size()*scale);
+         QImage const borderImage = WithBorder(image, 5, Qt::red);
+         QVector<int> counts = toInts(parser.value(spritesOpt));
+         if (!depths.isEmpty()) {
+            counts.clear();
+            qreal const ratio = qreal(size.width()) * size.height() / (image.width() * image.height());
+            for (auto d : depths)
+               counts.push_back(std::max(1, qRound(d * ratio)));
+         }
+         for (auto const count : counts)
+            for (auto const m : painters) {
+               QImage dst{size, QImage::Format_ARGB32_Premultiplied};
+               auto const make = [&](QImage &band) -> ImagePainter* {
+                  if (m == 1)
+                     return new DrawPainter{image, band};
+                  else if (m == 2 && zdepth == "16")
+                     return newZBufPainter<quint16>(borderImage, band, count, isa, ztiled);
+                  else if (m == 2 && zdepth == "float")
+                     return newZBufPainter<float>(borderImage, band, count, isa, ztiled);
+                  else if (m == 2)
+                     return newZBufPainter<quint8>(borderImage, band, count, isa, ztiled);
+                  else if (m == 3)
+                     return new FreeSpanDraw{borderImage, band};
+                  return nullptr;
+               };
+               std::unique_ptr<ImagePainter> painter;
+               if (bands) {
+                  auto *const bp = new BandPainter{m == 1 ? image : borderImage, dst, bands, make};
+                  painter.reset(bp);
+                  if (!bp->isValid())
+                     painter.reset();
+               } else
+                  painter.reset(make(dst));
+               if (!painter)
+                  continue;
+               static const char *const names[] = {"", "Painter", "Z-Buf", "FS-Buf"};
+               Config const cfg{size, count, scale};
+               auto const *const spans = skip ? dynamic_cast<const FreeSpanDraw*>(painter.get()) : nullptr;
+               auto const r = run(*painter, spans, image, dst, cfg, frames, warmup, seed);
+               qreal const pixels = qreal(frames) * size.width() * size.height();
+               printf("%-8s %5dx%-5d %7d %5.2g %6.2f %9.3f %9.3f %9.3f %9.3f %11lld %8.3f %8.2f\n",
+                      names[m], size.width(), size.height(), count, scale, r.covered / pixels,
+                      percentile(r.ns, 50) / 1e6, percentile(r.ns, 90) / 1e6,
+                      percentile(r.ns, 99) / 1e6, r.ns.back() / 1e6,
+                      r.written / frames, r.written / pixels, qreal(r.skipped) / frames);
+            }
+      }
+   return 0;
+}
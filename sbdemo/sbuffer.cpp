@@ -6,214 +6,8 @@
 **
 ** or mailto:agriff@tin.it 
 */
-#include <QtGui>
+#include "sbuffer.h"
 #include <array>
-#include <cmath>
-#include <cstdint>
-#include <cstring>
-#include <vector>
-
-int lineStep(const QImage &img, int subWidth) {
-   Q_ASSERT((img.bytesPerLine() * 8) % img.depth() == 0);
-   return -subWidth + ((img.height() > 1) ? img.bytesPerLine() * 8 / img.depth() : 0);
-}
-
-const QRgb *scanLine (const QImage &dst, const QPoint &pos) {
-   return reinterpret_cast<const QRgb*>(dst.scanLine(pos.y()) + pos.x()*sizeof(QRgb));
-}
-
-QRgb *scanLine (QImage &dst, const QPoint &pos) {
-   return reinterpret_cast<QRgb*>(dst.scanLine(pos.y()) + pos.x()*sizeof(QRgb));
-}
-
-template <typename T>
-class ZBuffer {
-   int const m_lineLength;
-   std::vector<T> m_buf;
-public:
-   static T maxZ() { return std::numeric_limits<T>::max(); }
-   explicit ZBuffer(const QImage &s, T value = maxZ()) :
-      m_lineLength(s.bytesPerLine()*8/s.depth()),
-      m_buf(m_lineLength*s.height(), value) {}
-   inline T *scanLine(const QPoint &pos) {
-      return m_buf.data() + m_lineLength * pos.y() + pos.x();
-   }
-   void clear() {
-      std::fill(m_buf.begin(), m_buf.end(), maxZ());
-   }
-};
-
-QImage WithBorder(QImage img, int width, const QColor &color = Qt::black) {
-   QPainter p(&img);
-   QPen pen(color);
-   pen.setWidth(width);
-   p.setPen(pen);
-   qreal a = width/2;
-   p.drawRect(QRectF(img.rect()).adjusted(a-1,a-1,-a,-a));
-   return img;
-}
-
-class ImagePainter {
-protected:
-   const QImage src;
-   QImage &dst;
-   virtual void draw(const QRect &dstRect, const QRect &srcRect) = 0;
-public:
-   ImagePainter(const QImage &src, QImage &dst) : src(src), dst(dst) {}
-   virtual void begin() {}
-   virtual void end() {}
-   virtual ~ImagePainter() {}
-   void draw(const QPoint &center) {
-      auto const p = center - src.rect().center();
-      auto const dstRect = QRect(p, src.size()).intersected(dst.rect());
-      if (!dstRect.isEmpty()) {
-         auto const srcRect = src.rect().intersected({-p, dst.size()});
-         draw(dstRect, srcRect);
-      }
-   }
-};
-
-class DrawPainter : public ImagePainter {
-   void draw(const QRect &dstRect, const QRect &srcRect) override {
-      QPainter p(&dst);
-      p.setCompositionMode(QPainter::CompositionMode_DestinationOver);
-      p.drawImage(dstRect, src, srcRect);
-   }
-public:
-   using ImagePainter::ImagePainter;
-   void begin() override {
-      dst.fill(Qt::transparent);
-   }
-   void end() override {
-      QPainter p(&dst);
-      p.setCompositionMode(QPainter::CompositionMode_DestinationOver);
-      p.fillRect(dst.rect(), Qt::black);
-   }
-};
-
-class ZBufPainter : public ImagePainter {
-   ZBuffer<quint8> zbuf{dst};
-   QImage fill{dst.width(), 1, dst.format()};
-   int z;
-   void draw(const QRect &dstRect, const QRect &srcRect, const QImage &src) {
-      Q_ASSERT(z < zbuf.maxZ());
-      auto *sp = scanLine(src, srcRect.topLeft());
-      auto *dp = scanLine(dst, dstRect.topLeft());
-      auto *zp = zbuf.scanLine(dstRect.topLeft());
-      const int sStep = lineStep(src, srcRect.width());
-      const int dStep = lineStep(dst, dstRect.width());
-      for (int i = dstRect.height(); i; i--) {
-         for (int j = dstRect.width(); j; j--) {
-            if (*zp > z) {
-               *zp = z;
-               *dp = *sp;
-            }
-            sp++; zp++; dp++;
-         }
-         sp += sStep; dp += dStep; zp += dStep; //zbuf has same layout as target image
-      }
-      ++z;
-   }
-   void draw(const QRect &dstRect, const QRect &srcRect) override {
-      draw(dstRect, srcRect, src);
-   }
-public:
-   ZBufPainter(const QImage &src, QImage &dst) : ImagePainter(src, dst) {
-      fill.fill(Qt::black);
-   }
-   void begin() override {
-      z = 0;
-      zbuf.clear();
-   }
-   void end() override {
-      draw(dst.rect(), fill.rect(), fill);
-   }
-};
-
-struct Span {
-   int x0 = 0, x1 = 0;
-   Span() = default;
-   Span(int x0, int x1) : x0(x0), x1(x1) {}
-   constexpr bool isEmpty() const { return x1 == x0; }
-   constexpr int size() const { return x1 - x0; }
-   bool operator<(const Span &o) const { return x1 <= o.x0; }
-};
-
-struct SpanDiffInter {
-   Span inter;    // a intersection b
-   Span diff[2];  // a difference b
-   bool after;    // a after b
-   explicit SpanDiffInter(const Span &a, const Span &b) {
-      Q_ASSERT(!(a.x1 <= b.x0));      // aa  bb  a1<=b0
-      if ((after = (b.x1 <= a.x0))) { // bb  aa  a0>=b1
-         diff[0] = a;
-      } else if (a.x0 < b.x0) {
-         if (a.x1 <= b.x1) {          // aa##bb  a0<b0,  a1<b1
-            diff[0] = {a.x0, b.x0};   // aa##    a0<b0,  a1==b1
-            inter   = {b.x0, a.x1};
-         } else {                     // aa##aa  a0<b0,  a1>b1
-            diff[0] = {a.x0, b.x0};
-            inter   = {b.x0, b.x1};
-            diff[1] = {b.x1, a.x1};
-         }
-      } else {
-         if (a.x1 > b.x1) {
-            inter   = {a.x0, b.x1};   //   ##aa  a0==b0, a1>b1
-            diff[0] = {b.x1, a.x1};   // bb##aa  a0>b0,  a1>b1
-         } else {
-            inter   = {a.x0, a.x1};   //   ##bb  a0==b0, a1<b1
-         }                            //   ##    a0==b0, a1==b1
-      }                               // bb##bb  a0>b0,  a1<b1
-   }                                  // bb##    a0>b0,  a1==b1
-};
-
-class FreeSpanDraw : public ImagePainter {
-   std::vector<std::vector<Span>> Spans{(size_t)dst.height()};
-
-   void DrawPart(const QPoint &d, const QPoint &s, int width)
-   {
-      auto *dp = scanLine(dst, d);
-      auto *sp = scanLine(src, s);
-      std::copy(sp, sp+width, dp);
-   }
-   void DrawSegment(const QPoint &dp, const QPoint &sp, int width)
-   {
-      const Span ds{dp.x(), dp.x() + width};
-      auto &spans = Spans[dp.y()];
-      for (auto is = std::lower_bound(spans.begin(), spans.end(), ds); is != spans.end(); )
-      {
-         SpanDiffInter const ss{*is, ds};
-         if (ss.after) break;
-         if (!ss.inter.isEmpty())
-            DrawPart({ss.inter.x0, dp.y()}, {sp.x()+ss.inter.x0-dp.x(), sp.y()}, ss.inter.size());
-         if (!ss.diff[0].isEmpty()) {
-            *is++ = ss.diff[0];
-            if (!ss.diff[1].isEmpty()) {
-               is = spans.insert(is, ss.diff[1]);
-               is++;
-            }
-         } else
-            is = spans.erase(is);
-      }
-   }
-   void draw(const QRect &dr, const QRect &sr) override {
-      for (int i = dr.height()-1; i>=0; i--)
-         DrawSegment({dr.x(), dr.y()+i}, {sr.x(), sr.y()+i}, dr.width());
-   }
-public:
-   using ImagePainter::ImagePainter;
-   void begin() override {
-      for (auto &spans : Spans) {
-         spans.resize(1);
-         spans[0] = {0, dst.width()};
-      }
-   }
-   void end() override {
-      for (int i=dst.height()-1; i>=0; i--)
-         for (auto  &s : qAsConst(Spans)[i])
-            std::fill_n(scanLine(dst, {s.x0, i}), s.size(), qRgb(0,0,0));
-   }
-};
 
 class Display : public QRasterWindow {
    Q_OBJECT
@@ -242,27 +36,6 @@ public:
    Q_SIGNAL void hasKey(int);
 };
 
-inline void bounce(qreal &x, qreal &v, qreal const left, qreal const right) {
-   qreal out;
-   if ((out = (x-left)) < 0 || (out = (x-right)) > 0) {
-      int n = out / (right - left);
-      x -= n * (right - left);
-      if (!(abs(n) % 2)) v = -v;
-   }
-   if ((out = (x-left)) < 0 || (out = (x-right)) > 0) {
-      x -= out*2;
-   }
-}
-
-struct State {
-   QPointF pos, vel;
-   void advance(qreal t, const QRectF &rect) {
-      pos += vel * t;
-      bounce(pos.rx(), vel.rx(), rect.x(), rect.x() + rect.width());
-      bounce(pos.ry(), vel.ry(), rect.y(), rect.y() + rect.height());
-   }
-};
-
 class Demo : public QObject {
    Q_OBJECT
    QImage dst{640, 400, QImage::Format_ARGB32_Premultiplied};
@@ -272,7 +45,14 @@ class Demo : public QObject {
    ZBufPainter zbuf{borderImage, dst};
    FreeSpanDraw span{borderImage, dst};
    const std::array<ImagePainter*, 3> painters{&draw, &zbuf, &span};
+   int const bands = QThread::idealThreadCount();
+   BandPainter bandDraw{image, dst, bands, [this](QImage &band) { return new DrawPainter{image, band}; }};
+   BandPainter bandZbuf{borderImage, dst, bands, [this](QImage &band) { return new ZBufPainter{borderImage, band}; }};
+   BandPainter bandSpan{borderImage, dst, bands, [this](QImage &band) { return new FreeSpanDraw{borderImage, band}; }};
+   const std::array<ImagePainter*, 3> bandPainters{&bandDraw, &bandZbuf, &bandSpan};
    ImagePainter *painter = painters.front();
+   int method = 1;
+   bool parallel = false;
    QVector<State> state{10};
    QBasicTimer timer;
    QElapsedTimer el;
@@ -290,7 +70,8 @@ class Demo : public QObject {
       Q_ASSERT(dst.isDetached());
       painter->begin();
       for (auto &s : state)
-         painter->draw(s.pos.toPoint());
+         if (painter != &span || !span.isFullyCovered(s.pos.toPoint()))
+            painter->draw(s.pos.toPoint());
       painter->end();
       emit hasImage(dst);
    }
@@ -309,10 +90,16 @@ public:
          setMethod(m);
       else if (key == Qt::Key_Space)
          toggleRunning();
+      else if (key == Qt::Key_P) {
+         parallel = !parallel;
+         setMethod(method);
+      }
    }
    void setMethod(int m) {
-      if (m >= 1 && m <= painters.size())
-         painter = painters[m-1];
+      if (m >= 1 && m <= painters.size()) {
+         method = m;
+         painter = parallel ? bandPainters[m-1] : painters[m-1];
+      }
       update();
    }
    void toggleRunning() {
@@ -332,7 +119,7 @@ int main(int argc, char *argv[])
    QImage src(":/monkey.bmp");
 
    Demo demo(src.convertToFormat(QImage::Format_ARGB32_Premultiplied).scaled(src.size()*2));
-   Display disp("<qt>1=Painter<br>2=Z-Buf<br>3=FS-Buf<br>Space=Pause</qt>");
+   Display disp("<qt>1=Painter<br>2=Z-Buf<br>3=FS-Buf<br>P=Bands<br>Space=Pause</qt>");
 
    QObject::connect(&disp, &Display::hasKey, &demo, &Demo::onKey);
    QObject::connect(&demo, &Demo::hasImage, &disp, &Display::setImage);
@@ -0,0 +1,572 @@
+#ifndef SBUFFER_H
+#define SBUFFER_H
+
+#include <QtGui>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "zkernel.h"
+
+inline int lineStep(const QImage &img, int subWidth) {
+   Q_ASSERT((img.bytesPerLine() * 8) % img.depth() == 0);
+   return -subWidth + ((img.height() > 1) ? img.bytesPerLine() * 8 / img.depth() : 0);
+}
+
+inline const QRgb *scanLine (const QImage &dst, const QPoint &pos) {
+   return reinterpret_cast<const QRgb*>(dst.scanLine(pos.y()) + pos.x()*sizeof(QRgb));
+}
+
+inline QRgb *scanLine (QImage &dst, const QPoint &pos) {
+   return reinterpret_cast<QRgb*>(dst.scanLine(pos.y()) + pos.x()*sizeof(QRgb));
+}
+
+// A tiled z-buffer also keeps, for each tileSize x tileSize tile, an upper
+// bound of its depths, exact for the tiles never written, and the list of
+// the tiles written since the last clear(), which only resets those.
+template <typename T>
+class ZBuffer {
+   int const m_lineLength, m_width, m_height;
+   std::vector<T> m_buf;
+   int const m_tileCols, m_tileRows;
+   std::vector<T> m_tileMax;
+   std::vector<quint8> m_touched;
+   std::vector<int> m_touchedList;
+public:
+   enum { tileSize = 16 };
+   static T maxZ() { return std::numeric_limits<T>::max(); }
+   explicit ZBuffer(const QImage &s, T value = maxZ(), bool tiled = false) :
+      m_lineLength(s.bytesPerLine()*8/s.depth()),
+      m_width(s.width()), m_height(s.height()),
+      m_buf(m_lineLength*s.height(), value),
+      m_tileCols(tiled ? (s.width() + tileSize - 1) / tileSize : 0),
+      m_tileRows(tiled ? (s.height() + tileSize - 1) / tileSize : 0),
+      m_tileMax(m_tileCols*m_tileRows, value),
+      m_touched(m_tileMax.size()) {}
+   inline T *scanLine(const QPoint &pos) {
+      return m_buf.data() + m_lineLength * pos.y() + pos.x();
+   }
+   bool isTiled() const { return !m_tileMax.empty(); }
+   // tile columns and rows, the tile at (tx, ty) covering the pixels from
+   // (tx, ty)*tileSize
+   int tileCols() const { return m_tileCols; }
+   int tileRows() const { return m_tileRows; }
+   T tileMax(int tx, int ty) const { return m_tileMax[ty*m_tileCols + tx]; }
+   bool isTouched(int tx, int ty) const { return m_touched[ty*m_tileCols + tx]; }
+   // the tiles tx0 to tx1 of row ty are about to be written
+   void touch(int tx0, int tx1, int ty) {
+      for (int i = ty*m_tileCols + tx0; i <= ty*m_tileCols + tx1; i++)
+         if (!m_touched[i]) {
+            m_touched[i] = true;
+            m_touchedList.push_back(i);
+         }
+   }
+   // every depth in rect is now z or less: lowers the bound of the tiles
+   // wholly inside it
+   void cover(const QRect &rect, T z) {
+      int const tx0 = (rect.left() + tileSize - 1) / tileSize;
+      int const ty0 = (rect.top() + tileSize - 1) / tileSize;
+      int const tx1 = rect.right() + 1 == m_width ? m_tileCols : (rect.right() + 1) / tileSize;
+      int const ty1 = rect.bottom() + 1 == m_height ? m_tileRows : (rect.bottom() + 1) / tileSize;
+      for (int ty = ty0; ty < ty1; ty++)
+         for (int tx = tx0; tx < tx1; tx++) {
+            T &max = m_tileMax[ty*m_tileCols + tx];
+            max = std::min(max, z);
+         }
+   }
+   void clear() {
+      if (!isTiled() || m_touchedList.size() > m_tileMax.size()/2) {
+         std::fill(m_buf.begin(), m_buf.end(), maxZ());
+         std::fill(m_tileMax.begin(), m_tileMax.end(), maxZ());
+         std::fill(m_touched.begin(), m_touched.end(), false);
+         m_touchedList.clear();
+         return;
+      }
+      for (int i : m_touchedList) {
+         int const x = i % m_tileCols * tileSize, y = i / m_tileCols * tileSize;
+         int const w = std::min<int>(tileSize, m_width - x);
+         for (int j = y; j < std::min<int>(y + tileSize, m_height); j++)
+            std::fill_n(scanLine({x, j}), w, maxZ());
+         m_tileMax[i] = maxZ();
+         m_touched[i] = false;
+      }
+      m_touchedList.clear();
+   }
+};
+
+inline QImage WithBorder(QImage img, int width, const QColor &color = Qt::black) {
+   QPainter p(&img);
+   QPen pen(color);
+   pen.setWidth(width);
+   p.setPen(pen);
+   qreal a = width/2;
+   p.drawRect(QRectF(img.rect()).adjusted(a-1,a-1,-a,-a));
+   return img;
+}
+
+class ImagePainter {
+protected:
+   const QImage src;
+   QImage &dst;
+   qint64 written = 0;
+   virtual void draw(const QRect &dstRect, const QRect &srcRect) = 0;
+public:
+   ImagePainter(const QImage &src, QImage &dst) : src(src), dst(dst) {}
+   virtual void begin() {}
+   virtual void end() {}
+   virtual ~ImagePainter() {}
+   // number of destination pixels stored so far, including the background fill
+   qint64 pixelsWritten() const { return written; }
+   void draw(const QPoint &center) {
+      auto const p = center - src.rect().center();
+      auto const dstRect = QRect(p, src.size()).intersected(dst.rect());
+      if (!dstRect.isEmpty()) {
+         auto const srcRect = src.rect().intersected({-p, dst.size()});
+         draw(dstRect, srcRect);
+      }
+   }
+};
+
+class DrawPainter : public ImagePainter {
+   void draw(const QRect &dstRect, const QRect &srcRect) override {
+      QPainter p(&dst);
+      p.setCompositionMode(QPainter::CompositionMode_DestinationOver);
+      p.drawImage(dstRect, src, srcRect);
+      written += qint64(dstRect.width()) * dstRect.height();
+   }
+public:
+   using ImagePainter::ImagePainter;
+   void begin() override {
+      dst.fill(Qt::transparent);
+   }
+   void end() override {
+      QPainter p(&dst);
+      p.setCompositionMode(QPainter::CompositionMode_DestinationOver);
+      p.fillRect(dst.rect(), Qt::black);
+      written += qint64(dst.width()) * dst.height();
+   }
+};
+
+template <typename T>
+class BasicZBufPainter : public ImagePainter {
+   ZBuffer<T> zbuf;
+   QImage fill{dst.width(), 1, dst.format()};
+   ZKernel::Row<T> row = ZKernel::row<T>(ZKernel::bestIsa());
+   T z;
+   // calls f(tx0, tx1, k) for each run of tiles from first to last of the
+   // same kind k
+   template <typename Kind, typename F>
+   static void forRuns(int first, int last, Kind kind, F f) {
+      for (int tx = first; tx <= last; ) {
+         auto const k = kind(tx);
+         int const tx0 = tx;
+         while (++tx <= last && kind(tx) == k) {}
+         f(tx0, tx - 1, k);
+      }
+   }
+   void draw(const QRect &dstRect, const QRect &srcRect, const QImage &src) {
+      Q_ASSERT(z < zbuf.maxZ());
+      auto *sp = scanLine(src, srcRect.topLeft());
+      auto *dp = scanLine(dst, dstRect.topLeft());
+      auto *zp = zbuf.scanLine(dstRect.topLeft());
+      const int width = dstRect.width();
+      const int sStep = width + lineStep(src, srcRect.width());
+      const int dStep = width + lineStep(dst, dstRect.width());
+      qint64 n = 0;
+      for (int i = dstRect.height(); i; i--) {
+         n += row(zp, dp, sp, width, z);
+         sp += sStep; dp += dStep; zp += dStep; //zbuf has same layout as target image
+      }
+      written += n;
+      ++z;
+   }
+   // skips the tiles already in front of z
+   void drawTiled(const QRect &dstRect, const QRect &srcRect) {
+      Q_ASSERT(z < zbuf.maxZ());
+      int const ts = ZBuffer<T>::tileSize;
+      auto *const sp = scanLine(src, srcRect.topLeft());
+      auto *const dp = scanLine(dst, dstRect.topLeft());
+      auto *const zp = zbuf.scanLine(dstRect.topLeft());
+      const int sLine = lineStep(src, 0), dLine = lineStep(dst, 0);
+      qint64 n = 0;
+      for (int ty = dstRect.top()/ts; ty <= dstRect.bottom()/ts; ty++) {
+         int const y0 = std::max(ty*ts, dstRect.top()) - dstRect.top();
+         int const y1 = std::min(ty*ts + ts, dstRect.bottom() + 1) - dstRect.top();
+         forRuns(dstRect.left()/ts, dstRect.right()/ts, [&](int tx) { return zbuf.tileMax(tx, ty) > z; },
+                 [&](int tx0, int tx1, bool behind) {
+            if (!behind)
+               return;
+            zbuf.touch(tx0, tx1, ty);
+            int const x0 = std::max(tx0*ts, dstRect.left()) - dstRect.left();
+            int const x1 = std::min(tx1*ts + ts, dstRect.right() + 1) - dstRect.left();
+            for (int y = y0; y < y1; y++)
+               n += row(zp + y*dLine + x0, dp + y*dLine + x0, sp + y*sLine + x0, x1 - x0, z);
+         });
+      }
+      zbuf.cover(dstRect, z);
+      written += n;
+      ++z;
+   }
+   // fills the tiles never written without testing their depths
+   void endTiled() {
+      enum { Front, Background, Mixed };
+      int const ts = ZBuffer<T>::tileSize;
+      auto *const sp = scanLine(fill, {0, 0});
+      auto *const dp = scanLine(dst, {0, 0});
+      auto *const zp = zbuf.scanLine({0, 0});
+      const int dLine = lineStep(dst, 0);
+      qint64 n = 0;
+      for (int ty = 0; ty < zbuf.tileRows(); ty++) {
+         int const y0 = ty*ts, y1 = std::min(y0 + ts, dst.height());
+         auto const kind = [&](int tx) {
+            return zbuf.tileMax(tx, ty) <= z ? Front : zbuf.isTouched(tx, ty) ? Mixed : Background;
+         };
+         forRuns(0, zbuf.tileCols() - 1, kind, [&](int tx0, int tx1, int k) {
+            int const x0 = tx0*ts, x1 = std::min(tx1*ts + ts, dst.width());
+            for (int y = y0; y < y1 && k != Front; y++)
+               if (k == Background) {
+                  std::copy(sp + x0, sp + x1, dp + y*dLine + x0);
+                  n += x1 - x0;
+               } else
+                  n += row(zp + y*dLine + x0, dp + y*dLine + x0, sp + x0, x1 - x0, z);
+         });
+      }
+      written += n;
+      ++z;
+   }
+   void draw(const QRect &dstRect, const QRect &srcRect) override {
+      if (zbuf.isTiled())
+         drawTiled(dstRect, srcRect);
+      else
+         draw(dstRect, srcRect, src);
+   }
+public:
+   // tiled rejects whole tiles in front of a sprite, and clears only the
+   // tiles written in the previous frame
+   BasicZBufPainter(const QImage &src, QImage &dst, bool tiled = true) :
+      ImagePainter(src, dst), zbuf(dst, ZBuffer<T>::maxZ(), tiled) {
+      fill.fill(Qt::black);
+   }
+   // number of sprites that fit in the depth range between begin() and end();
+   // float depths count up to where they stop being exact
+   static int maxDraws() {
+      return std::numeric_limits<T>::is_integer ? int(ZBuffer<T>::maxZ()) - 1 : (1 << 24) - 1;
+   }
+   // selects the row kernel, by default the best the CPU runs
+   void setIsa(ZKernel::Isa isa) { row = ZKernel::row<T>(isa); }
+   void begin() override {
+      z = 0;
+      zbuf.clear();
+   }
+   void end() override {
+      if (zbuf.isTiled())
+         endTiled();
+      else
+         draw(dst.rect(), fill.rect(), fill);
+   }
+};
+
+typedef BasicZBufPainter<quint8> ZBufPainter;
+
+struct Span {
+   int x0 = 0, x1 = 0;
+   Span() = default;
+   Span(int x0, int x1) : x0(x0), x1(x1) {}
+   constexpr bool isEmpty() const { return x1 == x0; }
+   constexpr int size() const { return x1 - x0; }
+   bool operator<(const Span &o) const { return x1 <= o.x0; }
+};
+
+struct SpanDiffInter {
+   Span inter;    // a intersection b
+   Span diff[2];  // a difference b
+   bool after;    // a after b
+   explicit SpanDiffInter(const Span &a, const Span &b) {
+      Q_ASSERT(!(a.x1 <= b.x0));      // aa  bb  a1<=b0
+      if ((after = (b.x1 <= a.x0))) { // bb  aa  a0>=b1
+         diff[0] = a;
+      } else if (a.x0 < b.x0) {
+         if (a.x1 <= b.x1) {          // aa##bb  a0<b0,  a1<b1
+            diff[0] = {a.x0, b.x0};   // aa##    a0<b0,  a1==b1
+            inter   = {b.x0, a.x1};
+         } else {                     // aa##aa  a0<b0,  a1>b1
+            diff[0] = {a.x0, b.x0};
+            inter   = {b.x0, b.x1};
+            diff[1] = {b.x1, a.x1};
+         }
+      } else {
+         if (a.x1 > b.x1) {
+            inter   = {a.x0, b.x1};   //   ##aa  a0==b0, a1>b1
+            diff[0] = {b.x1, a.x1};   // bb##aa  a0>b0,  a1>b1
+         } else {
+            inter   = {a.x0, a.x1};   //   ##bb  a0==b0, a1<b1
+         }                            //   ##    a0==b0, a1==b1
+      }                               // bb##bb  a0>b0,  a1<b1
+   }                                  // bb##    a0>b0,  a1==b1
+};
+
+// Free spans of every line, sorted, in one arena: line y owns the slots
+// starting at y*stride(), the first count[y] of which are in use. A line
+// outgrowing its slots doubles the capacity of all of them. The stride is
+// one cache line more than the capacity, so that the lines of a sprite do
+// not compete for the same cache sets.
+class SpanStore {
+   int m_capacity = 8;
+   std::vector<int> m_count;
+   std::vector<Span> m_spans;
+   int stride() const { return m_capacity + 64/sizeof(Span); }
+   void grow() {
+      SpanStore store(lines(), m_capacity * 2);
+      for (int y = 0; y < lines(); y++)
+         std::copy(begin(y), end(y), store.begin(y));
+      m_capacity = store.m_capacity;
+      m_spans.swap(store.m_spans);
+   }
+   SpanStore(int lines, int capacity) :
+      m_capacity(capacity), m_count(lines), m_spans(size_t(lines) * stride()) {}
+public:
+   explicit SpanStore(int lines) : SpanStore(lines, 8) {}
+   int lines() const { return int(m_count.size()); }
+   Span *begin(int y) { return m_spans.data() + size_t(y) * stride(); }
+   Span *end(int y) { return begin(y) + m_count[y]; }
+   const Span *begin(int y) const { return m_spans.data() + size_t(y) * stride(); }
+   const Span *end(int y) const { return begin(y) + m_count[y]; }
+   // makes every line a single span
+   void reset(const Span &span) {
+      for (int y = 0; y < lines(); y++) {
+         *begin(y) = span;
+         m_count[y] = 1;
+      }
+   }
+   // inserts span before pos in line y
+   void insert(int y, Span *pos, const Span &span) {
+      if (m_count[y] == m_capacity) {
+         int const i = pos - begin(y);
+         grow();
+         pos = begin(y) + i;
+      }
+      std::copy_backward(pos, end(y), end(y) + 1);
+      *pos = span;
+      m_count[y]++;
+   }
+   // removes the spans [first, last) of line y
+   void erase(int y, Span *first, Span *last) {
+      std::copy(last, end(y), first);
+      m_count[y] -= last - first;
+   }
+   // whether no span of line y overlaps s
+   bool noneOverlaps(int y, const Span &s) const {
+      auto *const i = std::lower_bound(begin(y), end(y), s);
+      return i == end(y) || i->x0 >= s.x1;
+   }
+};
+
+class FreeSpanDraw : public ImagePainter {
+   SpanStore Spans{dst.height()};
+
+   void DrawPart(const QPoint &d, const QPoint &s, int width)
+   {
+      auto *dp = scanLine(dst, d);
+      auto *sp = scanLine(src, s);
+      std::copy(sp, sp+width, dp);
+      written += width;
+   }
+   void DrawSegment(const QPoint &dp, const QPoint &sp, int width)
+   {
+      const Span ds{dp.x(), dp.x() + width};
+      int const y = dp.y();
+      auto *const end = Spans.end(y);
+      auto *is = std::lower_bound(Spans.begin(y), end, ds);
+      auto *keep = is;  // the spans left are compacted here, the rest erased at once
+      for (; is != end; ++is)
+      {
+         SpanDiffInter const ss{*is, ds};
+         if (ss.after) break;
+         if (!ss.inter.isEmpty())
+            DrawPart({ss.inter.x0, y}, {sp.x()+ss.inter.x0-dp.x(), sp.y()}, ss.inter.size());
+         if (!ss.diff[0].isEmpty()) {
+            *keep++ = ss.diff[0];
+            if (!ss.diff[1].isEmpty()) {
+               Spans.insert(y, keep, ss.diff[1]);
+               return;
+            }
+         }
+      }
+      if (keep != is)
+         Spans.erase(y, keep, is);
+   }
+   void draw(const QRect &dr, const QRect &sr) override {
+      for (int i = dr.height()-1; i>=0; i--)
+         DrawSegment({dr.x(), dr.y()+i}, {sr.x(), sr.y()+i}, dr.width());
+   }
+   // a free span repeated on the lines from y
+   struct Run {
+      Span span;
+      int y;
+   };
+   std::vector<Run> runs, nextRuns;
+   void FillRun(const Run &r, int y1)
+   {
+      int const width = r.span.size(), height = y1 - r.y;
+      auto *dp = scanLine(dst, {r.span.x0, r.y});
+      int const step = lineStep(dst, width);
+      if (!step)
+         std::fill_n(dp, qint64(width) * height, qRgb(0,0,0));
+      else
+         for (int i = 0; i < height; i++, dp += width + step)
+            std::fill_n(dp, width, qRgb(0,0,0));
+      written += qint64(width) * height;
+   }
+public:
+   using ImagePainter::ImagePainter;
+   void begin() override {
+      Spans.reset({0, dst.width()});
+   }
+   // fills what is left free with the background, the spans repeated on
+   // consecutive lines merged into one rectangle each
+   void end() override {
+      runs.clear();
+      for (int y = 0; y <= dst.height(); y++) {
+         nextRuns.clear();
+         auto *s = y < dst.height() ? Spans.begin(y) : nullptr;
+         auto *const e = y < dst.height() ? Spans.end(y) : nullptr;
+         auto r = runs.cbegin();
+         while (r != runs.cend() || s != e) {
+            if (r != runs.cend() && s != e && r->span.x0 == s->x0 && r->span.x1 == s->x1) {
+               nextRuns.push_back(*r++);
+               ++s;
+            } else if (r != runs.cend() && (s == e || r->span.x0 < s->x0))
+               FillRun(*r++, y);
+            else
+               nextRuns.push_back({*s++, y});
+         }
+         runs.swap(nextRuns);
+      }
+   }
+   // whether rect holds no free pixel, so a sprite drawn into it would not
+   // show; true as well for a rect outside of the target
+   bool isFullyCovered(const QRect &rect) const {
+      auto const r = rect.intersected(dst.rect());
+      const Span s{r.left(), r.left() + r.width()};
+      for (int y = r.top(); y <= r.bottom(); y++)
+         if (!Spans.noneOverlaps(y, s))
+            return false;
+      return true;
+   }
+   bool isFullyCovered(const QPoint &center) const {
+      return isFullyCovered(QRect(center - src.rect().center(), src.size()));
+   }
+};
+
+// Renders with one painter per horizontal band of the destination, each
+// band on a thread of its own. The sprites are only recorded until end(),
+// which replays all of them into every band, so each painter keeps the
+// spans or depths of its band and needs no locking.
+class BandPainter : public ImagePainter {
+public:
+   // creates the painter of a band, NULL if none
+   typedef std::function<ImagePainter*(QImage &band)> Factory;
+private:
+   struct Band {
+      int y, height;
+      QImage image;     // the rows of dst from y, sharing its memory
+      std::unique_ptr<ImagePainter> painter;
+   };
+   class Task : public QRunnable {
+      std::function<void()> const f;
+   public:
+      explicit Task(std::function<void()> f) : f(std::move(f)) {}
+      void run() override { f(); }
+   };
+   Factory const make;
+   int const count;
+   std::vector<std::unique_ptr<Band>> bands;
+   std::vector<QPoint> centers;
+   QThreadPool pool;
+   const uchar *bits = nullptr;
+   QSize splitSize;
+   void draw(const QRect &dstRect, const QRect &srcRect) override {
+      centers.push_back(dstRect.topLeft() - srcRect.topLeft() + src.rect().center());
+   }
+   // splits dst into bands, each with a new painter
+   void split() {
+      splitSize = dst.size();
+      bands.clear();
+      int const height = (dst.height() + count - 1) / count;
+      for (int y = 0; y < dst.height(); y += height)
+         bands.emplace_back(new Band{y, std::min(height, dst.height() - y), {}, {}});
+      map();
+      for (auto &b : bands)
+         b->painter.reset(make(b->image));
+      pool.setMaxThreadCount(std::min(int(bands.size()), QThread::idealThreadCount()));
+   }
+   // points the bands at the rows of dst, after it was detached
+   void map() {
+      bits = dst.bits();
+      for (auto &b : bands)
+         b->image = QImage(dst.scanLine(b->y), dst.width(), b->height, dst.bytesPerLine(), dst.format());
+   }
+   static void render(Band &b, const std::vector<QPoint> &centers) {
+      b.painter->begin();
+      for (auto const &c : centers)
+         b.painter->draw(c - QPoint(0, b.y));
+      b.painter->end();
+   }
+public:
+   BandPainter(const QImage &src, QImage &dst, int count, const Factory &make) :
+      ImagePainter(src, dst), make(make), count(count) {
+      split();
+   }
+   ~BandPainter() override {
+      pool.waitForDone();
+   }
+   // false when the factory made no painter for a band
+   bool isValid() const {
+      return std::all_of(bands.begin(), bands.end(), [](const std::unique_ptr<Band> &b) { return bool(b->painter); });
+   }
+   // a dst resized since the last frame is split again
+   void begin() override {
+      centers.clear();
+      if (dst.size() != splitSize)
+         split();
+      else if (dst.bits() != bits)
+         map();
+   }
+   void end() override {
+      for (auto &b : bands) {
+         Band &band = *b;
+         pool.start(new Task([&band, this] { render(band, centers); }));
+      }
+      pool.waitForDone();
+      written = 0;
+      for (auto &b : bands)
+         written += b->painter->pixelsWritten();
+   }
+};
+
+inline void bounce(qreal &x, qreal &v, qreal const left, qreal const right) {
+   qreal out;
+   if ((out = (x-left)) < 0 || (out = (x-right)) > 0) {
+      int n = out / (right - left);
+      x -= n * (right - left);
+      if (!(abs(n) % 2)) v = -v;
+   }
+   if ((out = (x-left)) < 0 || (out = (x-right)) > 0) {
+      x -= out*2;
+   }
+}
+
+struct State {
+   QPointF pos, vel;
+   void advance(qreal t, const QRectF &rect) {
+      pos += vel * t;
+      bounce(pos.rx(), vel.rx(), rect.x(), rect.x() + rect.width());
+      bounce(pos.ry(), vel.ry(), rect.y(), rect.y() + rect.height());
+   }
+};
+
+#endif
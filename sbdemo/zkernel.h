@@ -0,0 +1,215 @@
+#ifndef ZKERNEL_H
+#define ZKERNEL_H
+
+#include <QtGui>
+#include <cstdint>
+
+// Z-buffer row kernels: for n pixels, where the depth in zp is greater than
+// z, stores z and copies the source pixel to the destination; returns the
+// number of pixels stored. The vector kernels compare 16 to 32 depths at a
+// time and blend whole vectors of depths and pixels, rewriting the
+// unchanged ones. They are built with target attributes and chosen at run
+// time, so the rest of the program needs no special compiler flags.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ZKERNEL_X86 1
+#include <immintrin.h>
+#define ZKERNEL_SSE41 __attribute__((target("sse4.1")))
+#define ZKERNEL_AVX2 __attribute__((target("avx2")))
+#else
+#define ZKERNEL_X86 0
+#endif
+
+namespace ZKernel {
+
+enum Isa { Scalar, SSE41, AVX2 };
+
+// the best kernels the CPU runs
+inline Isa bestIsa() {
+#if ZKERNEL_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      return AVX2;
+   if (__builtin_cpu_supports("sse4.1"))
+      return SSE41;
+#endif
+   return Scalar;
+}
+
+inline const char *isaName(Isa isa) {
+   static const char *const names[] = {"scalar", "sse4.1", "avx2"};
+   return names[isa];
+}
+
+template <typename T>
+using Row = qint64 (*)(T *zp, QRgb *dp, const QRgb *sp, int n, T z);
+
+template <typename T>
+qint64 scalarRow(T *zp, QRgb *dp, const QRgb *sp, int n, T z) {
+   qint64 stored = 0;
+   for (int j = 0; j < n; j++)
+      if (zp[j] > z) {
+         zp[j] = z;
+         dp[j] = sp[j];
+         stored++;
+      }
+   return stored;
+}
+
+#if ZKERNEL_X86
+
+// copies the source pixels whose 32-bit lane of m is set
+
+ZKERNEL_SSE41 inline void blend4(QRgb *dp, const QRgb *sp, __m128i m) {
+   auto const d = _mm_loadu_si128((const __m128i*)dp);
+   auto const s = _mm_loadu_si128((const __m128i*)sp);
+   _mm_storeu_si128((__m128i*)dp, _mm_blendv_epi8(d, s, m));
+}
+
+ZKERNEL_AVX2 inline void blend8(QRgb *dp, const QRgb *sp, __m256i m) {
+   auto const d = _mm256_loadu_si256((const __m256i*)dp);
+   auto const s = _mm256_loadu_si256((const __m256i*)sp);
+   _mm256_storeu_si256((__m256i*)dp, _mm256_blendv_epi8(d, s, m));
+}
+
+// unsigned a > b as a == max(a, b+1), b+1 not overflowing since b < maxZ
+
+ZKERNEL_SSE41 inline qint64 sse41Row(quint8 *zp, QRgb *dp, const QRgb *sp, int n, quint8 z) {
+   auto const zv = _mm_set1_epi8(char(z)), z1 = _mm_set1_epi8(char(z + 1));
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 16 <= n; j += 16) {
+      auto const d = _mm_loadu_si128((const __m128i*)(zp + j));
+      auto const m = _mm_cmpeq_epi8(_mm_max_epu8(d, z1), d);
+      int const bits = _mm_movemask_epi8(m);
+      if (!bits)
+         continue;
+      _mm_storeu_si128((__m128i*)(zp + j), _mm_blendv_epi8(d, zv, m));
+      blend4(dp + j, sp + j, _mm_cvtepi8_epi32(m));
+      blend4(dp + j + 4, sp + j + 4, _mm_cvtepi8_epi32(_mm_srli_si128(m, 4)));
+      blend4(dp + j + 8, sp + j + 8, _mm_cvtepi8_epi32(_mm_srli_si128(m, 8)));
+      blend4(dp + j + 12, sp + j + 12, _mm_cvtepi8_epi32(_mm_srli_si128(m, 12)));
+      stored += __builtin_popcount(bits);
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+ZKERNEL_SSE41 inline qint64 sse41Row(quint16 *zp, QRgb *dp, const QRgb *sp, int n, quint16 z) {
+   auto const zv = _mm_set1_epi16(short(z)), z1 = _mm_set1_epi16(short(z + 1));
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 8 <= n; j += 8) {
+      auto const d = _mm_loadu_si128((const __m128i*)(zp + j));
+      auto const m = _mm_cmpeq_epi16(_mm_max_epu16(d, z1), d);
+      int const bits = _mm_movemask_epi8(m);
+      if (!bits)
+         continue;
+      _mm_storeu_si128((__m128i*)(zp + j), _mm_blendv_epi8(d, zv, m));
+      blend4(dp + j, sp + j, _mm_cvtepi16_epi32(m));
+      blend4(dp + j + 4, sp + j + 4, _mm_cvtepi16_epi32(_mm_srli_si128(m, 8)));
+      stored += __builtin_popcount(bits) / 2;
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+ZKERNEL_SSE41 inline qint64 sse41Row(float *zp, QRgb *dp, const QRgb *sp, int n, float z) {
+   auto const zv = _mm_set1_ps(z);
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 4 <= n; j += 4) {
+      auto const d = _mm_loadu_ps(zp + j);
+      auto const m = _mm_cmpgt_ps(d, zv);
+      int const bits = _mm_movemask_ps(m);
+      if (!bits)
+         continue;
+      _mm_storeu_ps(zp + j, _mm_blendv_ps(d, zv, m));
+      blend4(dp + j, sp + j, _mm_castps_si128(m));
+      stored += __builtin_popcount(bits);
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+ZKERNEL_AVX2 inline qint64 avx2Row(quint8 *zp, QRgb *dp, const QRgb *sp, int n, quint8 z) {
+   auto const zv = _mm256_set1_epi8(char(z)), z1 = _mm256_set1_epi8(char(z + 1));
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 32 <= n; j += 32) {
+      auto const d = _mm256_loadu_si256((const __m256i*)(zp + j));
+      auto const m = _mm256_cmpeq_epi8(_mm256_max_epu8(d, z1), d);
+      unsigned const bits = _mm256_movemask_epi8(m);
+      if (!bits)
+         continue;
+      _mm256_storeu_si256((__m256i*)(zp + j), _mm256_blendv_epi8(d, zv, m));
+      auto const lo = _mm256_castsi256_si128(m), hi = _mm256_extracti128_si256(m, 1);
+      blend8(dp + j, sp + j, _mm256_cvtepi8_epi32(lo));
+      blend8(dp + j + 8, sp + j + 8, _mm256_cvtepi8_epi32(_mm_srli_si128(lo, 8)));
+      blend8(dp + j + 16, sp + j + 16, _mm256_cvtepi8_epi32(hi));
+      blend8(dp + j + 24, sp + j + 24, _mm256_cvtepi8_epi32(_mm_srli_si128(hi, 8)));
+      stored += __builtin_popcount(bits);
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+ZKERNEL_AVX2 inline qint64 avx2Row(quint16 *zp, QRgb *dp, const QRgb *sp, int n, quint16 z) {
+   auto const zv = _mm256_set1_epi16(short(z)), z1 = _mm256_set1_epi16(short(z + 1));
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 16 <= n; j += 16) {
+      auto const d = _mm256_loadu_si256((const __m256i*)(zp + j));
+      auto const m = _mm256_cmpeq_epi16(_mm256_max_epu16(d, z1), d);
+      unsigned const bits = _mm256_movemask_epi8(m);
+      if (!bits)
+         continue;
+      _mm256_storeu_si256((__m256i*)(zp + j), _mm256_blendv_epi8(d, zv, m));
+      blend8(dp + j, sp + j, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(m)));
+      blend8(dp + j + 8, sp + j + 8, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(m, 1)));
+      stored += __builtin_popcount(bits) / 2;
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+ZKERNEL_AVX2 inline qint64 avx2Row(float *zp, QRgb *dp, const QRgb *sp, int n, float z) {
+   auto const zv = _mm256_set1_ps(z);
+   qint64 stored = 0;
+   int j = 0;
+   for (; j + 8 <= n; j += 8) {
+      auto const d = _mm256_loadu_ps(zp + j);
+      auto const m = _mm256_cmp_ps(d, zv, _CMP_GT_OQ);
+      int const bits = _mm256_movemask_ps(m);
+      if (!bits)
+         continue;
+      _mm256_storeu_ps(zp + j, _mm256_blendv_ps(d, zv, m));
+      blend8(dp + j, sp + j, _mm256_castps_si256(m));
+      stored += __builtin_popcount(bits);
+   }
+   return stored + scalarRow(zp + j, dp + j, sp + j, n - j, z);
+}
+
+// other depth types have no vector kernels
+template <typename T>
+qint64 sse41Row(T *zp, QRgb *dp, const QRgb *sp, int n, T z) {
+   return scalarRow(zp, dp, sp, n, z);
+}
+template <typename T>
+qint64 avx2Row(T *zp, QRgb *dp, const QRgb *sp, int n, T z) {
+   return scalarRow(zp, dp, sp, n, z);
+}
+
+#endif
+
+// the kernel for the depth type T, scalar when isa is not available
+template <typename T>
+Row<T> row(Isa isa) {
+#if ZKERNEL_X86
+   if (isa == AVX2)
+      return static_cast<Row<T>>(avx2Row);
+   if (isa == SSE41)
+      return static_cast<Row<T>>(sse41Row);
+#endif
+   Q_UNUSED(isa);
+   return scalarRow<T>;
+}
+
+}
+
+#endif
@@ -1,8 +1,43 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "asm_6502.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+// V6502_LAZY_FLAGS: N and Z are kept as the last result and derived only
+// when they are tested or the flags are read. Off by default: with the
+// flag tables the eager update is as cheap on the bench6502 workloads
+#ifndef V6502_LAZY_FLAGS
+#define V6502_LAZY_FLAGS 0
+#endif
+
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define NO_INLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#define NO_INLINE __declspec(noinline)
+#else
+#define FORCE_INLINE inline
+#define NO_INLINE
+#endif
 
 enum {
    f_negative	=	0x80,
@@ -15,15 +50,419 @@ enum {
    f_carry		=	0x01
 };
 
+// Flag tables, built at compile time
+
+constexpr uint8_t nz_of(int r) {
+   return (r & 0x80 ? f_negative : 0) | (r & 0xFF ? 0 : f_zero);
+}
+
+// N and Z of the low 8 bits, C from bit 8
+struct NZCTable {
+   uint8_t e[512];
+   constexpr NZCTable() : e{} {
+      for (int r = 0; r < 512; r++)
+         e[r] = nz_of(r) | r >> 8;
+   }
+};
+
+// ADC and SBC by carry and a << 8 | operand: the result in the low byte,
+// N, V, Z and C in the high byte. Binary SBC is ADC of the complement;
+// in decimal mode N, V and Z follow the NMOS 6502, see
+// http://www.6502.org/tutorials/decimal_mode.html
+
+constexpr uint16_t adc_binary(int a, int b, int c) {
+   int const r = a + b + c;
+   return (r & 0xFF) | (nz_of(r) | r >> 8 | ((~(a ^ b) & (a ^ r) & 0x80) ? f_overflow : 0)) << 8;
+}
+
+constexpr uint16_t adc_decimal(int a, int b, int c) {
+   int al = (a & 0x0F) + (b & 0x0F) + c;
+   if (al >= 10)
+      al = ((al + 6) & 0x0F) + 0x10;
+   int const as = (int8_t)(a & 0xF0) + (int8_t)(b & 0xF0) + al;
+   int au = (a & 0xF0) + (b & 0xF0) + al;
+   if (au >= 0xA0)
+      au += 0x60;
+   int const f = (nz_of(a + b + c) & f_zero) | (as & 0x80 ? f_negative : 0) |
+                 (as < -128 || as > 127 ? f_overflow : 0) | (au > 0xFF ? f_carry : 0);
+   return (au & 0xFF) | f << 8;
+}
+
+constexpr uint16_t sbc_decimal(int a, int b, int c) {
+   int al = (a & 0x0F) - (b & 0x0F) + c - 1;
+   if (al < 0)
+      al = ((al - 6) & 0x0F) - 0x10;
+   int as = (a & 0xF0) - (b & 0xF0) + al;
+   if (as < 0)
+      as -= 0x60;
+   return (as & 0xFF) | (adc_binary(a, b ^ 0xFF, c) & 0xFF00);
+}
+
+enum { alu_adc_binary, alu_adc_decimal, alu_sbc_decimal };
+
+struct ALUTable {
+   uint16_t e[2][65536];
+   constexpr ALUTable(int op) : e{} {
+      for (int c = 0; c < 2; c++)
+         for (int a = 0; a < 256; a++)
+            for (int b = 0; b < 256; b++)
+               e[c][a << 8 | b] = op == alu_adc_binary ? adc_binary(a, b, c) :
+                                  op == alu_adc_decimal ? adc_decimal(a, b, c) :
+                                  sbc_decimal(a, b, c);
+   }
+};
+
+static constexpr NZCTable nzc_flags;
+static constexpr ALUTable adc_binary_table{alu_adc_binary};
+static constexpr ALUTable adc_decimal_table{alu_adc_decimal};
+static constexpr ALUTable sbc_decimal_table{alu_sbc_decimal};
+
+// Timing of V6502_EXACT by operation and addressing mode
+
+enum {
+   timing_page_x = 0x01,   // an extra tick when ea - x and ea are on different pages
+   timing_page_y = 0x02,   // the same with y
+   timing_branch = 0x04,   // an extra tick when a taken branch crosses a page
+   timing_rmw    = 0x08,   // read-modify-write: the read 2 ticks before the write
+   timing_bit_branch = 0x10  // timing_branch for BBR/BBS, the offset after the operand
+};
+
+constexpr bool same(const char *a, const char *b) {
+   return *a == *b && (!*a || same(a + 1, b + 1));
+}
+
+constexpr bool starts(const char *a, const char *prefix) {
+   return !*prefix || (*a == *prefix && starts(a + 1, prefix + 1));
+}
+
+// the 6-tick RMW abs,X, the 65C02 shifts, take a tick more crossing a page
+constexpr int timing_of(const char *op, const char *mode, int cycles) {
+   return same(mode, "rel") ? timing_branch :
+          same(mode, "zprel") ? timing_bit_branch :
+          same(op, "asl") || same(op, "lsr") || same(op, "rol") || same(op, "ror") ||
+          same(op, "inc") || same(op, "dec") ||
+          same(op, "slo") || same(op, "rla") || same(op, "sre") || same(op, "rra") ||
+          same(op, "dcp") || same(op, "isc") ||
+          same(op, "tsb") || same(op, "trb") || starts(op, "rmb") || starts(op, "smb") ?
+             timing_rmw | (same(mode, "absx") && cycles == 6 ? timing_page_x : 0) :
+          same(op, "sta") || same(op, "stx") || same(op, "sty") || same(op, "sax") ||
+          same(op, "stz") ? 0 :
+          same(mode, "absx") ? timing_page_x :
+          same(mode, "absy") || same(mode, "zpiy") ? timing_page_y : 0;
+}
+
+// CPU variants: the template parameter of the engines and of the handlers
+// that differ between variants
+struct NMOS6502 { enum { id = V6502_NMOS, cmos = false }; };
+struct WDC65C02 { enum { id = V6502_65C02, cmos = true }; };
+
 struct V6502;
 using JumpEntry = void (V6502::*)();
+using BlockEntry = void (*)(V6502 *);
+
+// Translation cache: basic blocks decoded once into handler+operand records
+
+struct BlockInsn {
+   BlockEntry fn;       // op_pre instantiation
+   uint16_t operand;    // address, zero page address or branch target
+   uint8_t cycles;
+};
+
+struct Block {
+   std::vector<BlockInsn> insns;
+   int head;            // ticks of all instructions but the last one
+   int cycles;          // ticks of the whole block
+   uint16_t start;
+   uint8_t first_page, last_page;
+};
+
+struct BlockCache {
+   // translated blocks by start address, one table per 256 byte page
+   std::unique_ptr<std::unique_ptr<Block>[]> start[256];
+   // blocks having code on each page
+   std::vector<Block*> code[256];
+   // blocks invalidated during execute(), freed when it returns
+   std::vector<std::unique_ptr<Block>> retired;
+   Block *running;
+
+   Block *find(uint16_t addr) const {
+      auto *page = start[addr >> 8].get();
+      return page ? page[addr & 0xFF].get() : nullptr;
+   }
+   Block *translate(V6502 &v, uint16_t addr);
+   bool invalidate(int page);
+};
+
+// Copy-on-write storage of a 256 byte page, shared by snapshots and forks;
+// the last reference frees it
+struct Page {
+   std::atomic<int> refs;
+   unsigned char data[256];
+
+   static Page *ref(Page *p) {
+      p->refs.fetch_add(1, std::memory_order_relaxed);
+      return p;
+   }
+   static void release(Page *p) {
+      if (p && p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+         delete p;
+   }
+   static Page *copy(const unsigned char *data) {
+      auto *const p = new Page{{1}, {}};
+      memcpy(p->data, data, sizeof p->data);
+      return p;
+   }
+};
+
+// Rewind journal: a ring of 32-bit records, read backwards only. Every
+// instruction adds two words with the registers before it, every write to
+// memory one word with the old value:
+//
+//    instruction  pc | a << 16 | x << 24
+//                 y | s << 8 | flags << 16 | (cycle & 0x7F) << 24
+//    write        0x80000000 | old << 16 | addr
+//
+// A checkpoint marks an instruction boundary and its cycle every interval
+// ticks; the oldest checkpoints are dropped with their records to make room.
+
+struct RewindLog {
+   struct Checkpoint {
+      uint64_t pos;
+      long long cycle;
+   };
+   std::vector<uint32_t> ring;
+   uint64_t mask;       // ring.size() - 1, a power of two
+   uint64_t head, tail;
+   int interval;
+   std::deque<Checkpoint> checkpoints;
+
+   void push(uint32_t w) { ring[head++ & mask] = w; }
+   uint32_t pop() { return ring[--head & mask]; }
+
+   // starts a chunk of at most interval ticks, adding at most 2 words each
+   void checkpoint(long long cycle) {
+      uint64_t const need = 2 * (uint64_t)interval + 16;
+      while (!checkpoints.empty() && head - tail + need > ring.size()) {
+         checkpoints.pop_front();
+         tail = checkpoints.empty() ? head : checkpoints.front().pos;
+      }
+      checkpoints.push_back({head, cycle});
+   }
+   void clear() {
+      head = tail = 0;
+      checkpoints.clear();
+   }
+};
+
+// Profiler counters. Calls are followed through JSR/BRK and RTS/RTI to
+// build a call tree; a frame is left once the stack pointer rises above
+// the one it was entered with, which also covers stack manipulations.
+
+struct Profile {
+   uint64_t op_count[256], op_ticks[256];
+   // per address of the opcode
+   std::vector<uint64_t> pc_count, pc_ticks;
+   // device accesses per address
+   std::vector<uint64_t> io_reads, io_writes;
+
+   struct Node {
+      int parent;
+      uint16_t addr;       // entry point, 0 for the root
+      uint64_t ticks;
+   };
+   struct Frame {
+      int node;
+      uint8_t s;           // stack pointer after the call
+   };
+   std::vector<Node> nodes{{-1, 0, 0}};
+   std::unordered_map<uint32_t, int> children;   // parent << 16 | addr
+   std::vector<Frame> frames;
+   int node = 0;
+
+   Profile() : pc_count(65536), pc_ticks(65536), io_reads(65536), io_writes(65536) {
+      std::fill_n(op_count, 256, 0);
+      std::fill_n(op_ticks, 256, 0);
+   }
+
+   void enter(uint16_t addr, uint8_t s) {
+      auto const key = (uint32_t)node << 16 | addr;
+      auto it = children.find(key);
+      if (it == children.end()) {
+         it = children.emplace(key, nodes.size()).first;
+         nodes.push_back({node, addr, 0});
+      }
+      node = it->second;
+      if (frames.size() < 256)
+         frames.push_back({node, s});
+   }
+   void leave(uint8_t s) {
+      while (!frames.empty() && frames.back().s < s)
+         frames.pop_back();
+      node = frames.empty() ? 0 : frames.back().node;
+   }
+};
+
+// Timed events: a binary heap, earliest first and in scheduling order on
+// ties; cancelling is rare and takes linear time
+
+struct EventQueue {
+   struct Event {
+      long long cycle;
+      int id;
+      Event6502 fn;
+      void *user;
+   };
+   std::vector<Event> heap;
+   int next_id;
+
+   static bool later(const Event &a, const Event &b) {
+      return a.cycle != b.cycle ? a.cycle > b.cycle : a.id > b.id;
+   }
+   bool due(long long cycle) const {
+      return !heap.empty() && heap.front().cycle <= cycle;
+   }
+   int push(long long cycle, Event6502 fn, void *user) {
+      heap.push_back({cycle, ++next_id, fn, user});
+      std::push_heap(heap.begin(), heap.end(), later);
+      return next_id;
+   }
+   Event pop() {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      auto const e = heap.back();
+      heap.pop_back();
+      return e;
+   }
+   bool cancel(int id) {
+      auto const it = std::find_if(heap.begin(), heap.end(), [&](const Event &e) { return e.id == id; });
+      if (it == heap.end())
+         return false;
+      heap.erase(it);
+      std::make_heap(heap.begin(), heap.end(), later);
+      return true;
+   }
+};
+
+// reasons for trapping writes to pages with writable storage
+enum {
+   trap_code    =  0x01,   // translated code on the page
+   trap_cow     =  0x02,   // storage shared with a snapshot or fork
+   trap_journal =  0x04,   // writes recorded for rewinding
+   trap_idle    =  0x08,   // writes checked while watching a polling loop
+   trap_dirty   =  0x10    // first write since the dirty pages were taken
+};
+
+// mapping of a shared address space: the 64K and the Shared6502 page
+enum { shared_size = 65536 + 4096 };
 
 struct V6502 : Virtual_6502 {
-   unsigned char *pc, *ea, *stk;
-   uint8_t flags, y, x, a;
+   uint16_t pc, ea;
+   uint8_t flags, y, x, a, s;
+#if V6502_LAZY_FLAGS
+   // N and Z: Z is clear when the low byte is not zero, N is set when
+   // bit 7 or bit 8 is; N and Z of flags are stale
+   uint16_t nz;
+#endif
+   // page of the last code fetch and its storage, -1 when not cached
+   int code_page;
+   const unsigned char *code;
+   BlockCache *cache;
+   RewindLog *rewind;
+   EventQueue *events;
+   // profiler counters, kept when profiling stops
+   Profile *profile;
+   bool profiling;
+   const BlockInsn *cur, *blk_end;
+
+   // memory map: direct storage to read and write each page, NULL when the
+   // access has to go through read_slow()/write_slow()
+   unsigned char *rd[256], *wr[256];
+   // writable storage of each page, NULL for ROM and I/O pages
+   unsigned char *ram[256];
+   struct IOPage {
+      IORead6502 read;
+      IOWrite6502 write;
+      void *user;
+   } io[256];
+   uint8_t trap[256];
+   // copy-on-write storage of each page, NULL for other storage
+   Page *pages[256];
+   // address_space pages as copied by the last snapshot, reused by the
+   // next one when unchanged
+   Page *shadow[256];
+   // pages mapped by Map6502/MapIO6502, left alone by the legacy fields
+   bool mapped[256];
+   // legacy fields as last applied to the memory map
+   unsigned char *map_special_start, *map_special_end, *map_rom_start;
+   // ticks left when Stop6502 was called
+   int stop_ticks;
+   // address_space is a private mapping of a state file
+   bool image_mapped;
+   // address_space is shared memory followed by the Shared6502 page, fd
+   // is the memory to map in other processes
+   Shared6502 *shared;
+   int shared_fd;
+   // in Execute6502, the cycle at which ticks reaches 0 in the running
+   // slice, and the ticks put aside until the slice ends
+   bool running;
+   long long tick_base;
+   int slice_rest;
+   // IRQ sources holding the line, and NMI and RESET waiting for the next
+   // instruction boundary
+   unsigned irq_lines;
+   bool nmi_pending;
+   bool reset_pending;
+   // 65C02: executing WAI, PC points at it until an interrupt
+   bool waiting;
+   // idle skipping: the last device read, with the registers and the
+   // cycle it happened at; once armed, writes changing memory and other
+   // device accesses end the watch, and the read repeating unchanged
+   // proves the loop idle
+   bool skip_idle;
+   struct IdleWatch {
+      long long cycle;
+      uint64_t regs;
+      uint16_t pc, addr;
+      uint8_t value;
+      bool armed;
+      int backoff;      // repeats to let go by after a failed watch
+   } idle;
+   // V6502_EXACT: the instruction is timed, its first ticks value, its
+   // read-modify-write read left to time, and the cycle of the device
+   // access in progress if timed
+   bool exact;
+   int exact_start;
+   bool exact_rmw;
+   bool timed;
+   long long access_cycle;
+
+   // dirty page tracking: started by the first DirtyPages6502 call, the
+   // pages written since the last one; pages still clean are trapped
+   bool dirty_tracking;
+   uint8_t dirty[32];
+
+   // ticks while stopped, far enough below zero to end every run loop
+   enum { stop_bias = -0x40000000 };
 
    void execute();
-   uint16_t pc_val() const { return (uintptr_t)pc; }
+   void load_registers();
+   void store_registers();
+   void run_slices();
+   void run_engine();
+   template <class Cpu> void run_engine();
+   template <class Cpu, bool Profile> void run_table();
+   template <class Cpu, bool Record, bool Exact> void run_switch();
+   template <class Cpu> void run_cached();
+   bool step_back();
+   void shorten_slice(long long cycle);
+   void record();
+   void take_interrupt();
+
+   void map(int page, unsigned char *read, unsigned char *write, IOPage handlers);
+   void map_shared(int page, Page *storage, bool writable);
+   void map_legacy();
+   void map_legacy(int page);
+   static int legacy_read(Virtual_6502 *v, int addr, void *);
+   static void legacy_write(Virtual_6502 *v, int addr, int value, void *);
 
    template <int cycles, JumpEntry Op, JumpEntry Addr>
    void op_impl() {
@@ -32,70 +471,363 @@ struct V6502 : Virtual_6502 {
       (*this.*Op)();
    }
 
+   template <int cycles, JumpEntry Op, JumpEntry Addr, int Timing>
+   void op_exact() {
+      exact_start = ticks;
+      exact_rmw = Timing & timing_rmw;
+      ticks -= cycles;
+      (*this.*Addr)();
+      if (((Timing & timing_page_x) && ((ea - x) ^ ea) & 0xFF00) ||
+          ((Timing & timing_page_y) && ((ea - y) ^ ea) & 0xFF00))
+         ticks--;
+      uint16_t const next = pc + ((Timing & timing_bit_branch) ? 1 : 0);
+      (*this.*Op)();
+      if ((Timing & (timing_branch | timing_bit_branch)) && (pc ^ next) & 0xFF00)
+         ticks--;
+   }
+
+   // the data accesses come last, a read-modify-write reads 2 ticks
+   // before writing
+   void time_access() {
+      int const spent = exact_start - ticks;
+      special_tick = exact_rmw ? spent - 3 : spent - 1;
+      exact_rmw = false;
+      access_cycle = tick_base - exact_start + special_tick;
+      timed = true;
+   }
+
+   // instruction of a translated block; the block charges the ticks
+   template <JumpEntry Op, JumpEntry Pre>
+   static void op_pre(V6502 *v) {
+      (*v.*Pre)();
+      (*v.*Op)();
+   }
+
    constexpr static uint16_t make_u16(uint8_t lo, uint16_t hi) {
       return hi << 8 | lo;
    }
 
    // Memory Transfers
 
-   uint16_t mreadw(uint16_t addr) {
-      return make_u16(mread(address_space+addr+0),
-                      mread(address_space+addr+1));
+   FORCE_INLINE uint16_t mreadw(uint16_t addr) {
+      return make_u16(mread(addr), mread(addr+1));
+   }
+
+   // pointer in zero page: the high byte wraps to $00
+   FORCE_INLINE uint16_t mreadzp(uint8_t zp) {
+      return make_u16(mread(zp), mread((uint8_t)(zp + 1)));
+   }
+
+   // JMP (ind): the high byte is read from the same page
+   FORCE_INLINE uint16_t mreadind(uint16_t addr) {
+      return make_u16(mread(addr), mread((addr & 0xFF00) | ((addr + 1) & 0xFF)));
    }
 
-   uint8_t mread() {
+   FORCE_INLINE uint8_t mread() {
       return mread(ea);
    }
 
-   uint8_t mread(unsigned char *ea) {
-      if (ea < special_start || ea >= special_end)
-         return *ea;
-      special_ea = ea;
-      special_read(this, special_user);
-      return *ea = special_value;
+   FORCE_INLINE uint8_t mread(uint16_t addr) {
+      if (auto *p = rd[addr >> 8])
+         return p[addr & 0xFF];
+      return read_slow(addr);
    }
 
-   void mwrite(uint8_t val) {
-      if (ea < special_start || ea >= special_end) {
-         if (ea < rom_start)
-            *ea = val;
-      } else {
-         special_ea = ea;
-         special_value = val;
-         special_write(this, special_user);
+   NO_INLINE uint8_t read_slow(uint16_t addr) {
+      auto const &h = io[addr >> 8];
+      if (!h.read)
+         return 0xFF;
+      if (profiling && h.read != legacy_read)
+         profile->io_reads[addr]++;
+      uint8_t val;
+      if (!exact)
+         val = h.read(this, addr, h.user);
+      else {
+         time_access();
+         val = h.read(this, addr, h.user);
+         timed = false;
       }
+      if (skip_idle)
+         idle_read(addr, val);
+      return val;
    }
 
-   uint8_t  fetch()  { return *pc++; }
-   int8_t   fetchi() { return *pc++; }
-   uint16_t fetchw() { return pc += 2, make_u16(pc[-2], pc[-1]); }
+   // a device read repeating with the registers unchanged and no memory
+   // changed in between: the rest of the slice would only repeat it, skip
+   // it in whole iterations
+   void idle_read(uint16_t addr, uint8_t val) {
+      uint64_t const regs = a | x << 8 | y << 16 | (uint32_t)s << 24 |
+                            (uint64_t)get_flags() << 32;
+      long long const now = tick_base - ticks;
+      auto &w = idle;
+      if (w.pc != pc || w.addr != addr || w.value != val || w.regs != regs ||
+          rewind || profiling) {
+         idle_disarm();
+         w = {now, regs, pc, addr, val, false, 0};
+         return;
+      }
+      if (w.armed) {
+         long long const period = now - w.cycle;
+         if (period > 0)
+            ticks -= ticks / period * period;
+      } else if (w.backoff)
+         w.backoff--;
+      else
+         idle_arm();
+      w.cycle = tick_base - ticks;
+   }
+
+   void idle_arm() {
+      idle.armed = true;
+      for (int page = 0; page < 256; page++)
+         if (ram[page]) {
+            trap[page] |= trap_idle;
+            update_page(page);
+         }
+   }
+
+   void idle_disarm() {
+      if (!idle.armed)
+         return;
+      idle.armed = false;
+      for (int page = 0; page < 256; page++)
+         if (trap[page] & trap_idle) {
+            trap[page] &= ~trap_idle;
+            update_page(page);
+         }
+   }
+
+   // the loop changed something: not idle, and not worth watching again
+   // for a while
+   void idle_failed() {
+      idle_disarm();
+      idle.backoff = 256;
+   }
+
+   FORCE_INLINE void mwrite(uint8_t val) {
+      mwrite(ea, val);
+   }
+
+   FORCE_INLINE void mwrite(uint16_t addr, uint8_t val) {
+      if (auto *p = wr[addr >> 8])
+         p[addr & 0xFF] = val;
+      else
+         write_slow(addr, val);
+   }
+
+   NO_INLINE void write_slow(uint16_t addr, uint8_t val) {
+      int const page = addr >> 8;
+      if (trap[page] & trap_code)
+         code_written(page);
+      if (trap[page] & trap_cow)
+         cow_written(page);
+      auto const &h = io[page];
+      if (h.write && idle.armed)
+         idle_failed();
+      if (h.write) {
+         if (profiling && h.write != legacy_write)
+            profile->io_writes[addr]++;
+         if (exact)
+            time_access();
+         h.write(this, addr, val, h.user);
+         timed = false;
+      } else if (ram[page]) {
+         if (trap[page] & trap_journal)
+            journal(addr, ram[page][addr & 0xFF]);
+         if ((trap[page] & trap_idle) && ram[page][addr & 0xFF] != val)
+            idle_failed();
+         if (trap[page] & trap_dirty)
+            mark_dirty(page);
+         ram[page][addr & 0xFF] = val;
+      }
+   }
+
+   // the content of the page changed
+   void mark_dirty(int page) {
+      dirty[page >> 3] |= 1 << (page & 7);
+      if (trap[page] & trap_dirty) {
+         trap[page] &= ~trap_dirty;
+         update_page(page);
+      }
+   }
+
+   void journal(uint16_t addr, uint8_t old) {
+      rewind->push(0x80000000u | old << 16 | addr);
+   }
+
+   // stores into the storage of a page, as the CPU would without devices
+   void poke(uint16_t addr, uint8_t val) {
+      int const page = addr >> 8;
+      if (!ram[page])
+         return;
+      if (trap[page] & trap_code)
+         code_written(page);
+      if (trap[page] & trap_cow)
+         cow_written(page);
+      mark_dirty(page);
+      ram[page][addr & 0xFF] = val;
+   }
+
+   void update_page(int page) {
+      wr[page] = trap[page] ? nullptr : ram[page];
+   }
+
+   FORCE_INLINE uint8_t fetch() {
+      uint16_t const addr = pc++;
+      if ((addr >> 8) == code_page)
+         return code[addr & 0xFF];
+      return fetch_slow(addr);
+   }
+
+   NO_INLINE uint8_t fetch_slow(uint16_t addr) {
+      code = rd[addr >> 8];
+      code_page = code ? addr >> 8 : -1;
+      return mread(addr);
+   }
+
+   int8_t   fetchi() { return fetch(); }
+   uint16_t fetchw() { auto lo = fetch(); return make_u16(lo, fetch()); }
+
+   FORCE_INLINE void    push(uint8_t val) { mwrite(0x100 | s--, val); }
+   FORCE_INLINE uint8_t pull()            { return mread(0x100 | ++s); }
 
 
    // Address Calculations
 
    void lea_nop() {}
 
-   void lea_abs()  { ea = address_space + fetchw(); }
-   void lea_absy() { ea = address_space + fetchw() + y; }
-   void lea_absx() { ea = address_space + fetchw() + x; }
-   void lea_zp()   { ea = address_space + fetch(); }
-   void lea_zpx()  { ea = address_space + ((fetch() + x) & 0xFF); }
-   void lea_zpy()  { ea = address_space + ((fetch() + y) & 0xFF); }
-   void lea_zpiy() { ea = address_space + mreadw(fetch()) + y; }
-   void lea_zpxi() { ea = address_space + mreadw(fetch() + x); }
-   void lea_absi() { ea = address_space + mreadw(fetchw()); }
-   void lea_rel()  { ea = pc + fetchi(); }
+   void lea_abs()  { ea = fetchw(); }
+   void lea_absy() { ea = fetchw() + y; }
+   void lea_absx() { ea = fetchw() + x; }
+   void lea_zp()   { ea = fetch(); }
+   void lea_zpx()  { ea = (fetch() + x) & 0xFF; }
+   void lea_zpy()  { ea = (fetch() + y) & 0xFF; }
+   void lea_zpiy() { ea = mreadzp(fetch()) + y; }
+   void lea_zpxi() { ea = mreadzp(fetch() + x); }
+   void lea_absi() { ea = mreadind(fetchw()); }
+   void lea_rel()  { auto d = fetchi(); ea = pc + d; }
+
+   // 65C02: (zp), JMP (abs) without the page wrap, JMP (abs,X), and the
+   // zero page operand of BBR/BBS, the branch displacement left to fetch
+   void lea_zpi()   { ea = mreadzp(fetch()); }
+   void lea_ind()   { ea = mreadw(fetchw()); }
+   void lea_absxi() { ea = mreadw(fetchw() + x); }
+   void lea_zprel() { ea = fetch(); }
+
+   // Address Calculations from pre-decoded operands
+
+   void pre_nop() {}
+
+   void pre_abs()  { pc += 2; ea = cur->operand; }
+   void pre_absy() { pc += 2; ea = cur->operand + y; }
+   void pre_absx() { pc += 2; ea = cur->operand + x; }
+   void pre_zp()   { pc++; ea = cur->operand; }
+   void pre_zpx()  { pc++; ea = (cur->operand + x) & 0xFF; }
+   void pre_zpy()  { pc++; ea = (cur->operand + y) & 0xFF; }
+   void pre_zpiy() { pc++; ea = mreadzp(cur->operand) + y; }
+   void pre_zpxi() { pc++; ea = mreadzp(cur->operand + x); }
+   void pre_absi() { pc += 2; ea = mreadind(cur->operand); }
+   void pre_zpi()   { pc++; ea = mreadzp(cur->operand); }
+   void pre_ind()   { pc += 2; ea = mreadw(cur->operand); }
+   void pre_absxi() { pc += 2; ea = mreadw(cur->operand + x); }
+   void pre_zprel() { pc++; ea = cur->operand & 0xFF; }
+   void pre_rel()  { pc++; ea = cur->operand; }
+
+   // the page was written or remapped: drop its translated code
+   void code_written(int page) {
+      trap[page] &= ~trap_code;
+      update_page(page);
+      if (cache->invalidate(page))
+         blk_end = cur + 1;
+   }
+
+   // the page was written while shared: take a private copy
+   void cow_written(int page) {
+      auto *const p = pages[page];
+      if (p->refs.load(std::memory_order_acquire) > 1) {
+         pages[page] = Page::copy(p->data);
+         Page::release(p);
+         rd[page] = ram[page] = pages[page]->data;
+         if (page == code_page)
+            code = rd[page];
+      }
+      trap[page] &= ~trap_cow;
+      update_page(page);
+   }
+
+   // Flags
+
+#if V6502_LAZY_FLAGS
+   static uint16_t nz_of_flags(uint8_t f) {
+      return (f & f_zero ? 0 : 1) | (f & f_negative) << 1;
+   }
+
+   void setzn(uint8_t val) { nz = val; }
+
+   // sets N and Z from the low 8 bits of r and C from bit 8
+   uint8_t setznc(int r) {
+      flags = (flags & ~f_carry) | (r >> 8 & f_carry);
+      return nz = r & 0xFF;
+   }
+
+   // sets N, V, Z and C from f; N and Z are those of result unless in
+   // decimal mode
+   void setnvzc(uint8_t f, uint8_t result) {
+      flags = (flags & ~(f_overflow | f_carry)) | (f & (f_overflow | f_carry));
+      nz = flags & f_decimal ? nz_of_flags(f) : result;
+   }
+
+   // BIT: N and V from v, Z from v & a
+   void setbit(uint8_t v) {
+      flags = (flags & ~f_overflow) | (v & f_overflow);
+      nz = (v & a) | (v & 0x80) << 1;
+   }
+
+   // Z alone, N kept in bit 8
+   void setz(bool z) {
+      nz = (negative() ? 0x100 : 0) | !z;
+   }
+
+   bool negative() const { return nz & 0x180; }
+   bool zero() const { return !(nz & 0xFF); }
 
-   // Zero & Negative Setup
+   uint8_t get_flags() const {
+      return (flags & ~(f_zero | f_negative)) | (zero() ? f_zero : 0) | (negative() ? f_negative : 0);
+   }
+   void set_flags(uint8_t f) {
+      flags = f;
+      nz = nz_of_flags(f);
+   }
+#else
+   void setzn(uint8_t val) {
+      flags = (flags & ~(f_zero | f_negative)) | nzc_flags.e[val];
+   }
+
+   uint8_t setznc(int r) {
+      flags = (flags & ~(f_zero | f_negative | f_carry)) | nzc_flags.e[r];
+      return r;
+   }
+
+   void setnvzc(uint8_t f, uint8_t) {
+      flags = (flags & ~(f_negative | f_overflow | f_zero | f_carry)) | f;
+   }
+
+   void setbit(uint8_t v) {
+      flags = (flags & ~(f_negative | f_overflow | f_zero)) |
+              (v & (f_negative | f_overflow)) | (v & a ? 0 : f_zero);
+   }
 
-   void setzn(int8_t val) {
-      flags &= ~(f_zero | f_negative);
-      if (!val)
-         flags |= f_zero;
-      if (val < 0)
-         flags |= f_negative;
+   void setz(bool z) {
+      flags = (flags & ~f_zero) | (z ? f_zero : 0);
    }
 
+   bool negative() const { return flags & f_negative; }
+   bool zero() const { return flags & f_zero; }
+
+   uint8_t get_flags() const { return flags; }
+   void set_flags(uint8_t f) { flags = f; }
+#endif
+
    // Operations
 
    void op_nop() {}
@@ -124,14 +856,14 @@ struct V6502 : Virtual_6502 {
       }
    }
 
-   void op_bpl()  { jump_if(!(flags & f_negative)); }
-   void op_bmi()  { jump_if(flags & f_negative); }
+   void op_bpl()  { jump_if(!negative()); }
+   void op_bmi()  { jump_if(negative()); }
    void op_bvc()  { jump_if(!(flags & f_overflow)); }
    void op_bvs()  { jump_if(flags & f_overflow); }
    void op_bcc()  { jump_if(!(flags & f_carry)); }
    void op_bcs()  { jump_if(flags & f_carry); }
-   void op_bne()  { jump_if(!(flags & f_zero)); }
-   void op_beq()  { jump_if(flags & f_zero); }
+   void op_bne()  { jump_if(!zero()); }
+   void op_beq()  { jump_if(zero()); }
 
    void op_oraimm() { setzn(a |= fetch()); }
    void op_ora()    { setzn(a |= mread()); }
@@ -139,382 +871,1766 @@ struct V6502 : Virtual_6502 {
    void op_and()    { setzn(a &= mread()); }
    void op_eorimm() { setzn(a ^= fetch()); }
    void op_eor()    { setzn(a ^= mread()); }
-   void op_inc()    { mwrite(mread() + 1); }
-   void op_dec()    { mwrite(mread() - 1); }
+   void op_inc()    { uint8_t v = mread() + 1; mwrite(v); setzn(v); }
+   void op_dec()    { uint8_t v = mread() - 1; mwrite(v); setzn(v); }
 
-   void op_asl()    { auto v = mread(); flags = (flags & ~f_carry) | (v >> 7); mwrite(v << 1); }
-   void op_asla()   {                   flags = (flags & ~f_carry) | (a >> 7); setzn(a << 1); }
-   void op_lsr()    { auto v = mread(); flags = (flags & ~f_carry) | (a & 1); mwrite(v >> 1); }
-   void op_lsra()   {                   flags = (flags & ~f_carry) | (a & 1); setzn(a >> 1); }
+   uint8_t asl(uint8_t v) { return setznc(v << 1); }
+   uint8_t lsr(uint8_t v) { return setznc((v & 1) << 8 | v >> 1); }
+   void op_asl()    { mwrite(asl(mread())); }
+   void op_asla()   { a = asl(a); }
+   void op_lsr()    { mwrite(lsr(mread())); }
+   void op_lsra()   { a = lsr(a); }
 
    void op_bit() {
       auto v = mread();
-      flags &= ~(f_overflow | f_negative | f_zero);
-      if (v & 0x40) flags |= f_overflow;
-      if (v & 0x80) flags |= f_negative;
-      if (!(v & a)) flags |= f_zero;
+      setbit(v);
    }
    void op_clc() { flags &= ~f_carry; }
    void op_sec() { flags |=  f_carry; }
    void op_cld() { flags &= ~f_decimal; }
    void op_sed() { flags |=  f_decimal; }
-   void op_cli() { flags &= ~f_interrupt; }
+   void op_cli() { flags &= ~f_interrupt; irq_unmasked(); }
    void op_sei() { flags |=  f_interrupt; }
    void op_clv() { flags &= ~f_overflow; }
 
-   void cmp(int16_t v) {
-      flags = (flags &= ~f_carry);
-      if (v >= 0) flags |= f_carry;
-      setzn(v);
-   }
+   // bit 8 of r + 0x100 - v is the carry: set unless r < v
+   void cmp(uint8_t r, uint8_t v) { setznc(r + 0x100 - v); }
 
-   void op_cmpimm() { cmp(a - fetch()); }
-   void op_cmp()    { cmp(a - mread()); }
-   void op_cpximm() { cmp(x - fetch()); }
-   void op_cpx()    { cmp(x - mread()); }
-   void op_cpyimm() { cmp(y - fetch()); }
-   void op_cpy()    { cmp(y - mread()); }
+   void op_cmpimm() { cmp(a, fetch()); }
+   void op_cmp()    { cmp(a, mread()); }
+   void op_cpximm() { cmp(x, fetch()); }
+   void op_cpx()    { cmp(x, mread()); }
+   void op_cpyimm() { cmp(y, fetch()); }
+   void op_cpy()    { cmp(y, mread()); }
 
    void op_jmp()    { pc = ea; }
    void op_jsr() {
       pc--;
-      *stk-- = pc_val() >> 8;
-      *stk-- = pc_val();
+      push(pc >> 8);
+      push(pc);
       pc = ea;
    }
 
-   void op_pha() { *stk-- = a;     }
-   void op_php() { *stk-- = flags; }
+   void op_pha() { push(a);     }
+   // B only exists on the stack: PHP pushes it set, PLP and RTI drop it
+   void op_php() { push(get_flags() | f_break | f_unused); }
 
-   void op_pla() { a = *++stk; setzn(a); }
-   void op_plp() { flags = (*++stk | f_unused); }
+   void op_pla() { a = pull(); setzn(a); }
+   void op_plp() { set_flags((pull() | f_unused) & ~f_break); irq_unmasked(); }
 
-   uint8_t rol(uint8_t v) {
-      uint8_t carry = flags & f_carry;
-      flags = (flags & ~f_carry) | (v >> 7);
-      return (v << 1) | carry;
-   }
+   uint8_t rol(uint8_t v) { return setznc(v << 1 | (flags & f_carry)); }
    void op_rol()  { mwrite(rol(mread())); }
-   void op_rola() { setzn(a = rol(a));    }
+   void op_rola() { a = rol(a); }
 
-   uint8_t ror(uint8_t v) {
-      uint8_t carry = flags & f_carry;
-      flags = (flags & ~f_carry) | (v & 1);
-      return (carry << 7) | (v >> 1);
-   }
+   uint8_t ror(uint8_t v) { return setznc((v & 1) << 8 | (flags & f_carry) << 7 | v >> 1); }
    void op_ror()  { mwrite(ror(mread())); }
-   void op_rora() { setzn(a = ror(a));    }
+   void op_rora() { a = ror(a); }
 
    void pop_pc() {
-      pc = address_space + make_u16(stk[1], stk[2]);
-      stk += 2;
+      auto lo = pull();
+      pc = make_u16(lo, pull());
    }
    void op_rts() { pop_pc(); pc++; }
-   void op_rti() { pop_pc(); flags = *++stk; }
+   void op_rti() { set_flags((pull() | f_unused) & ~f_break); pop_pc(); irq_unmasked(); }
+
+   // pushes PC and P, B set for BRK only, and jumps through the vector
+   void interrupt(uint16_t vector, uint8_t b) {
+      push(pc >> 8);
+      push(pc);
+      push(get_flags() | b | f_unused);
+      flags |= f_interrupt;
+      pc = mreadw(vector);
+   }
+
+   // BRK skips the byte after it; the 65C02 also clears D
+   template <class Cpu> void op_brk() {
+      pc++;
+      interrupt(0xFFFE, f_break);
+      if (Cpu::cmos)
+         flags &= ~f_decimal;
+   }
 
-   void op_brk() {
-      *stk-- = pc_val();
-      *stk-- = pc_val() >> 8;
-      *stk-- = flags;
-      pc = address_space + mreadw(0xFFFE);
-      flags |= f_break | f_interrupt;
+   // I was cleared with IRQ held: end the slice to take it
+   void irq_unmasked() {
+      if (irq_lines && !(flags & f_interrupt))
+         shorten_slice(tick_base - ticks);
    }
 
    void op_txa() { setzn(a = x); }
    void op_tya() { setzn(a = y); }
    void op_tax() { setzn(x = a); }
    void op_tay() { setzn(y = a); }
-   void op_tsx() { setzn(x = (uintptr_t)stk); }
-   void op_txs() { stk = address_space + 0x100 + x; }
-
-   // according to http://www.6502.org/tutorials/decimal_mode.html
-   void adc(uint8_t b) {
-      uint8_t const carry_in = flags & f_carry;
-      flags &= ~(f_carry | f_negative | f_overflow);
-      int16_t as;
-      if (flags & f_decimal) {
-         uint8_t al = (a & 0x0F) + (b & 0x0F) + carry_in;
-         if (al >= 10) al = ((al + 6) & 0x0F) + 0x10;
-         // C
-         uint16_t au = (a & 0xf0) + (b & 0xf0) + al;
-         if (au >= 0xA0) au += 0x60;
-         a = au;
-         if (au >= 0x100) flags |= f_carry;
-         // N, V
-         as = (int8_t)(a & 0xf0);
-         as += (int8_t)(b & 0xf0);
-         as += (int8_t)al;
-      } else {
-         as = (int8_t)a;
-         as += (int8_t)b;
-         as += carry_in;
-         a = as;
-      }
-      if (!a) flags |= f_zero;
-      if (as & 0x80) flags |= f_negative;
-      if (as < -128 || as > 127) flags |= f_overflow;
-   }
-   void op_adcimm() { adc(fetch()); }
-   void op_adc()    { adc(mread()); }
-
-   // according to http://www.6502.org/tutorials/decimal_mode.html
-   void sbc(uint8_t b) { //tbd
-      uint8_t const carry_in = flags & f_carry;
-      flags &= ~(f_carry | f_negative | f_overflow);
-      int16_t as;
-      if (flags & f_decimal) {
-         int8_t al = (a & 0x0F) - (b & 0x0F) + carry_in - 1;
-         if (al < 0) al = ((al - 6) & 0x0F) - 0x10;
-         as = (a & 0xf0) - (b & 0xf0) + al;
-         if (as < 0) as -= 0x60;
-      } else {
-         as = (int8_t)a;
-         as -= (int8_t)b;
-         as += carry_in;
-         as -= 1;
+   void op_tsx() { setzn(x = s); }
+   void op_txs() { s = x; }
+
+   void alu(const ALUTable &t, uint8_t b) {
+      uint16_t const r = t.e[flags & f_carry][a << 8 | b];
+      a = r;
+      setnvzc(r >> 8, r);
+   }
+
+   // the 65C02 takes a tick more in decimal mode, and sets N and Z from
+   // the result
+   template <class Cpu> void decimal(const ALUTable &t, uint8_t b) {
+      alu(t, b);
+      if (Cpu::cmos) {
+         setzn(a);
+         ticks--;
+      }
+   }
+
+   template <class Cpu> void adc(uint8_t b) {
+      if (flags & f_decimal)
+         decimal<Cpu>(adc_decimal_table, b);
+      else
+         alu(adc_binary_table, b);
+   }
+   template <class Cpu> void op_adcimm() { adc<Cpu>(fetch()); }
+   template <class Cpu> void op_adc()    { adc<Cpu>(mread()); }
+
+   template <class Cpu> void sbc(uint8_t b) {
+      if (flags & f_decimal)
+         decimal<Cpu>(sbc_decimal_table, b);
+      else
+         alu(adc_binary_table, b ^ 0xFF);
+   }
+   template <class Cpu> void op_sbcimm() { sbc<Cpu>(fetch()); }
+   template <class Cpu> void op_sbc()    { sbc<Cpu>(mread()); }
+
+   // Undocumented NMOS opcodes: the stable ones only
+
+   void op_nopimm() { fetch(); }
+   void op_lax()    { setzn(a = x = mread()); }
+   void op_sax()    { mwrite(a & x); }
+   void op_slo()    { uint8_t v = asl(mread()); mwrite(v); setzn(a |= v); }
+   void op_rla()    { uint8_t v = rol(mread()); mwrite(v); setzn(a &= v); }
+   void op_sre()    { uint8_t v = lsr(mread()); mwrite(v); setzn(a ^= v); }
+   void op_rra()    { uint8_t v = ror(mread()); mwrite(v); adc<NMOS6502>(v); }
+   void op_dcp()    { uint8_t v = mread() - 1; mwrite(v); cmp(a, v); }
+   void op_isc()    { uint8_t v = mread() + 1; mwrite(v); sbc<NMOS6502>(v); }
+
+   // ANC: AND, then C from N
+   void op_ancimm() { a &= fetch(); setznc(a | (a & 0x80) << 1); }
+   void op_alrimm() { a = lsr(a & fetch()); }
+   void op_sbximm() { x = setznc((a & x) + 0x100 - fetch()); }
+
+   // ARR: AND then ROR, C and V from bits 6 and 5; decimal mode fixes
+   // up each nibble the way the NMOS ALU does
+   void op_arrimm() {
+      uint8_t const t = a & fetch();
+      uint8_t r = (flags & f_carry) << 7 | t >> 1;
+      if (!(flags & f_decimal)) {
+         a = r;
+         setnvzc((r & f_negative) | (r ? 0 : f_zero) | (r >> 6 & f_carry) |
+                 ((r ^ r << 1) & f_overflow), r);
+         return;
+      }
+      uint8_t f = (r & f_negative) | (r ? 0 : f_zero) | ((r ^ t) & f_overflow);
+      if ((t & 0x0F) + (t & 0x01) > 5)
+         r = (r & 0xF0) | ((r + 6) & 0x0F);
+      if ((t & 0xF0) + (t & 0x10) > 0x50) {
+         f |= f_carry;
+         r += 0x60;
       }
-      a = as;
-      if (!a) flags |= f_zero;
-      if (as & 0x80) flags |= f_negative;
-      if (as < -128 || as > 127) flags |= f_overflow;
+      a = r;
+      setnvzc(f, r);
+   }
+
+   // 65C02
+
+   void op_bra()    { jump_if(true); }
+   void op_stz()    { mwrite(0); }
+   void op_inca()   { setzn(++a); }
+   void op_deca()   { setzn(--a); }
+   void op_phx()    { push(x); }
+   void op_phy()    { push(y); }
+   void op_plx()    { setzn(x = pull()); }
+   void op_ply()    { setzn(y = pull()); }
+
+   // BIT #imm only sets Z
+   void op_bitimm() { setz(!(a & fetch())); }
+
+   // TSB and TRB: Z from the old value & a
+   void op_tsb() { uint8_t v = mread(); setz(!(v & a)); mwrite(v | a); }
+   void op_trb() { uint8_t v = mread(); setz(!(v & a)); mwrite(v & ~a); }
+
+   void op_rmb0() { mwrite(mread() & ~0x01); }
+   void op_rmb1() { mwrite(mread() & ~0x02); }
+   void op_rmb2() { mwrite(mread() & ~0x04); }
+   void op_rmb3() { mwrite(mread() & ~0x08); }
+   void op_rmb4() { mwrite(mread() & ~0x10); }
+   void op_rmb5() { mwrite(mread() & ~0x20); }
+   void op_rmb6() { mwrite(mread() & ~0x40); }
+   void op_rmb7() { mwrite(mread() & ~0x80); }
+   void op_smb0() { mwrite(mread() |  0x01); }
+   void op_smb1() { mwrite(mread() |  0x02); }
+   void op_smb2() { mwrite(mread() |  0x04); }
+   void op_smb3() { mwrite(mread() |  0x08); }
+   void op_smb4() { mwrite(mread() |  0x10); }
+   void op_smb5() { mwrite(mread() |  0x20); }
+   void op_smb6() { mwrite(mread() |  0x40); }
+   void op_smb7() { mwrite(mread() |  0x80); }
+
+   void branch_bit(bool c) {
+      auto d = fetchi();
+      if (c) {
+         pc += d;
+         ticks--;
+      }
+   }
+   void op_bbr0() { branch_bit(!(mread() & 0x01)); }
+   void op_bbr1() { branch_bit(!(mread() & 0x02)); }
+   void op_bbr2() { branch_bit(!(mread() & 0x04)); }
+   void op_bbr3() { branch_bit(!(mread() & 0x08)); }
+   void op_bbr4() { branch_bit(!(mread() & 0x10)); }
+   void op_bbr5() { branch_bit(!(mread() & 0x20)); }
+   void op_bbr6() { branch_bit(!(mread() & 0x40)); }
+   void op_bbr7() { branch_bit(!(mread() & 0x80)); }
+   void op_bbs0() { branch_bit(mread() & 0x01); }
+   void op_bbs1() { branch_bit(mread() & 0x02); }
+   void op_bbs2() { branch_bit(mread() & 0x04); }
+   void op_bbs3() { branch_bit(mread() & 0x08); }
+   void op_bbs4() { branch_bit(mread() & 0x10); }
+   void op_bbs5() { branch_bit(mread() & 0x20); }
+   void op_bbs6() { branch_bit(mread() & 0x40); }
+   void op_bbs7() { branch_bit(mread() & 0x80); }
+
+   // WAI stays on itself until an interrupt is pending, with I set or
+   // not; take_interrupt() steps over it. Interrupts only come between
+   // slices, so the rest of the slice goes by at once. The journal keeps 7
+   // bits of the cycle of each instruction, so while journaling it goes by
+   // in steps of at most 127 ticks, leaving none or at least the 3 of the
+   // next step so that the slice still ends at 0
+   void op_wai() {
+      if (irq_lines || nmi_pending || reset_pending)
+         return;
+      waiting = true;
+      pc--;
+      if (ticks > 0)
+         ticks -= !rewind || ticks <= 124 ? ticks : std::min(124, ticks - 3);
    }
-   void op_sbcimm() { sbc(fetch()); }
-   void op_sbc()    { sbc(mread()); }
 
    void op_illegal() {}
 };
 
-Virtual_6502 *New6502(void)
+// allocates an instance followed by extra bytes
+static V6502 *Alloc6502(int engine, int extra)
 {
-   int size = sizeof(V6502)+65536*2;
+   int size = sizeof(V6502)+extra;
    auto *const v6502 = (V6502*)malloc(size);
    if (!v6502)
       return {};
    memset(v6502,0,size);
-   v6502->address_space=
-         (unsigned char *)(((uintptr_t)v6502+sizeof(V6502)+65535)&~65535);
-   memset(v6502->address_space,0xFF,65536);
+   v6502->engine=engine;
+   if (engine == V6502_CACHED)
+      v6502->cache = new BlockCache{};
+   return v6502;
+}
+
+// maps every page to address_space
+static void Attach6502(V6502 *v6502, unsigned char *address_space)
+{
+   v6502->address_space=address_space;
    v6502->special_start=v6502->address_space;
    v6502->special_end=v6502->address_space;
    v6502->rom_start=v6502->address_space;
+   v6502->map_legacy();
+}
+
+Virtual_6502 *New6502(int engine, int cpu)
+{
+   auto *const v6502 = Alloc6502(engine, 65536);
+   if (!v6502)
+      return {};
+   v6502->cpu = cpu;
+   memset(v6502+1,0xFF,65536);
+   Attach6502(v6502, (unsigned char *)(v6502+1));
    return v6502;
 }
 
 void Free6502(Virtual_6502 *v6502)
 {
+   auto *const v = static_cast<V6502*>(v6502);
+   for (int page = 0; page < 256; page++) {
+      Page::release(v->pages[page]);
+      Page::release(v->shadow[page]);
+   }
+   delete v->cache;
+   delete v->rewind;
+   delete v->events;
+   delete v->profile;
+#ifdef HAVE_MMAP
+   if (v->image_mapped)
+      munmap(v->address_space, 65536);
+   if (v->shared) {
+      munmap(v->address_space, shared_size);
+      close(v->shared_fd);
+   }
+#endif
    free(v6502);
 }
 
+// Shared address space: the 64K followed by a page holding the
+// Shared6502. The sequence is a seqlock on the registers and on memory.
+
+static std::atomic<unsigned> &Sequence(const Shared6502 *state)
+{
+   static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "sequence layout");
+   return *reinterpret_cast<std::atomic<unsigned>*>(const_cast<unsigned*>(&state->sequence));
+}
+
+// Keeps the sequence odd while the API changes memory or registers of a
+// shared instance, then publishes the registers. Nested writers, such as a
+// Poke6502 from an I/O handler, leave it to the outermost one.
+struct SharedWriter {
+   explicit SharedWriter(V6502 *v) : v(v->shared ? v : nullptr) {
+      if (!this->v)
+         return;
+      auto &s = Sequence(v->shared);
+      seq = s.load(std::memory_order_relaxed);
+      if (seq & 1) {
+         this->v = nullptr;
+         return;
+      }
+      s.store(seq | 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+   }
+   ~SharedWriter() {
+      if (!v)
+         return;
+      auto &st = *v->shared;
+      st.PC = v->PC;
+      st.A = v->A;
+      st.X = v->X;
+      st.Y = v->Y;
+      st.S = v->S;
+      st.P = v->P;
+      st.cycle = v->cycle;
+      Sequence(v->shared).store(seq + 2, std::memory_order_release);
+   }
+   SharedWriter(const SharedWriter &) = delete;
+   SharedWriter &operator=(const SharedWriter &) = delete;
+
+   V6502 *v;
+   unsigned seq = 0;
+};
+
+#ifdef HAVE_MMAP
+// memory other processes can map through the fd
+static int SharedMemory(size_t size)
+{
+#ifdef __linux__
+   int const fd = memfd_create("v6502", MFD_CLOEXEC);
+#else
+   char name[32];
+   snprintf(name, sizeof name, "/v6502-%d", (int)getpid());
+   int const fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   if (fd >= 0)
+      shm_unlink(name);
+#endif
+   if (fd >= 0 && ftruncate(fd, size)) {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+#endif
+
+Virtual_6502 *NewShared6502(int engine, int cpu)
+{
+#ifdef HAVE_MMAP
+   int const fd = SharedMemory(shared_size);
+   if (fd < 0)
+      return {};
+   void *const p = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   auto *const v6502 = p != MAP_FAILED ? Alloc6502(engine, 0) : nullptr;
+   if (!v6502) {
+      if (p != MAP_FAILED)
+         munmap(p, shared_size);
+      close(fd);
+      return {};
+   }
+   auto *const mem = (unsigned char *)p;
+   v6502->cpu = cpu;
+   v6502->shared = (Shared6502 *)(mem + 65536);
+   v6502->shared_fd = fd;
+   memset(mem, 0xFF, 65536);
+   Attach6502(v6502, mem);
+   return v6502;
+#else
+   (void)engine;
+   (void)cpu;
+   return {};
+#endif
+}
+
+int SharedFd6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   return v->shared ? v->shared_fd : -1;
+}
+
+const unsigned char *MapShared6502(int fd)
+{
+#ifdef HAVE_MMAP
+   void *const p = mmap(nullptr, shared_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (p != MAP_FAILED)
+      return (const unsigned char *)p;
+#else
+   (void)fd;
+#endif
+   return {};
+}
+
+void UnmapShared6502(const unsigned char *mem)
+{
+#ifdef HAVE_MMAP
+   munmap(const_cast<unsigned char *>(mem), shared_size);
+#else
+   (void)mem;
+#endif
+}
+
+unsigned Sequence6502(const unsigned char *mem)
+{
+   return Sequence((const Shared6502 *)(mem + 65536)).load(std::memory_order_acquire);
+}
+
+bool Unchanged6502(const unsigned char *mem, unsigned sequence)
+{
+   std::atomic_thread_fence(std::memory_order_acquire);
+   return !(sequence & 1) &&
+          Sequence((const Shared6502 *)(mem + 65536)).load(std::memory_order_relaxed) == sequence;
+}
+
+void Flush6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (!v->cache)
+      return;
+   *v->cache = {};
+   for (int page = 0; page < 256; page++) {
+      v->trap[page] &= ~trap_code;
+      v->update_page(page);
+   }
+}
+
+void Map6502(Virtual_6502 *v6502, int first, int count,
+             unsigned char *read, unsigned char *write)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   SharedWriter const writer(v);
+   for (int i = 0; i < count && first + i < 256; i++) {
+      v->map(first + i, read ? read + i*256 : nullptr, write ? write + i*256 : nullptr, {});
+      v->mapped[first + i] = true;
+   }
+}
+
+void MapIO6502(Virtual_6502 *v6502, int first, int count,
+               IORead6502 read, IOWrite6502 write, void *user)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   SharedWriter const writer(v);
+   for (int i = 0; i < count && first + i < 256; i++) {
+      v->map(first + i, nullptr, nullptr, {read, write, user});
+      v->mapped[first + i] = true;
+   }
+}
+
+// Snapshots keep the registers and the memory map. Pages with storage in
+// address_space are copied, unless unchanged since the previous snapshot;
+// copy-on-write pages are shared. Host memory and I/O handlers are kept as
+// they are. The pages of address_space are compared rather than trapped,
+// as the host writes to them directly: 64K of memcmp per snapshot.
+
+struct Snapshot6502 {
+   int PC, A, X, Y, S, P, cpu;
+   long long cycle;
+   struct Entry {
+      Page *mem;                    // storage, NULL for host memory and I/O
+      int offset;                   // address_space offset of the storage, -1 if none
+      bool writable, mapped;
+      unsigned char *read, *write;  // host memory when mem is NULL
+      V6502::IOPage io;
+   } pages[256];
+};
+
+Snapshot6502 *Save6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   auto *const snap = new Snapshot6502{v->PC, v->A, v->X, v->Y, v->S, v->P, v->cpu, v->cycle, {}};
+   unsigned char *const as = v->address_space;
+   for (int page = 0; page < 256; page++) {
+      auto &e = snap->pages[page];
+      unsigned char *const rd = v->rd[page];
+      e.mapped = v->mapped[page];
+      e.offset = -1;
+      if (v->pages[page]) {
+         e.mem = Page::ref(v->pages[page]);
+         e.writable = v->ram[page] != nullptr;
+         if (e.writable) {
+            v->trap[page] |= trap_cow;
+            v->update_page(page);
+         }
+      } else if (as && (!e.mapped || (rd >= as && rd <= as + 0xFF00))) {
+         unsigned char *const base = e.mapped ? rd : as + page*256;
+         e.offset = base - as;
+         e.writable = e.mapped ? v->ram[page] != nullptr : base < v->rom_start;
+         auto *&shadow = v->shadow[page];
+         if (!shadow || memcmp(shadow->data, base, 256)) {
+            Page::release(shadow);
+            shadow = Page::copy(base);
+         }
+         e.mem = Page::ref(shadow);
+      } else {
+         e.read = rd;
+         e.write = v->ram[page];
+         e.io = v->io[page];
+      }
+   }
+   return snap;
+}
+
+void Restore6502(Virtual_6502 *v6502, const Snapshot6502 *snap)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   SharedWriter const writer(v);
+   unsigned char *const as = v->address_space;
+   for (int page = 0; page < 256; page++) {
+      auto const &e = snap->pages[page];
+      if (!e.mem) {
+         v->map(page, e.read, e.write, e.io);
+         v->mapped[page] = true;
+      } else if (!as) {
+         v->map_shared(page, e.mem, e.writable);
+         v->mapped[page] = true;
+      } else {
+         // storage in address_space: the page content is copied back
+         bool const mapped = e.mapped && e.offset >= 0;
+         unsigned char *const base = as + (mapped ? e.offset : page*256);
+         if (mapped)
+            v->map(page, base, e.writable ? base : nullptr, {});
+         else if (v->mapped[page] || v->pages[page]) {
+            v->mapped[page] = false;
+            v->map_legacy(page);
+         }
+         v->mapped[page] = mapped;
+         if (memcmp(base, e.mem->data, 256)) {
+            if (v->trap[page] & trap_code)
+               v->code_written(page);
+            v->mark_dirty(page);
+            memcpy(base, e.mem->data, 256);
+         }
+         Page::release(v->shadow[page]);
+         v->shadow[page] = Page::ref(e.mem);
+      }
+   }
+   v->PC = snap->PC;
+   v->A = snap->A;
+   v->X = snap->X;
+   v->Y = snap->Y;
+   v->S = snap->S;
+   v->P = snap->P;
+   v->cycle = snap->cycle;
+   if (v->rewind)
+      v->rewind->clear();
+}
+
+void FreeSnapshot6502(Snapshot6502 *snap)
+{
+   for (auto &e : snap->pages)
+      Page::release(e.mem);
+   delete snap;
+}
+
+Virtual_6502 *Fork6502(const Snapshot6502 *snap, int engine)
+{
+   auto *const v6502 = Alloc6502(engine, 0);
+   if (!v6502)
+      return {};
+   v6502->cpu = snap->cpu;
+   Restore6502(v6502, snap);
+   return v6502;
+}
+
+Virtual_6502 *Fork6502(Virtual_6502 *v6502)
+{
+   auto *const snap = Save6502(v6502);
+   auto *const fork = Fork6502(snap, v6502->engine);
+   FreeSnapshot6502(snap);
+   return fork;
+}
+
+int Peek6502(Virtual_6502 *v6502, int addr)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   auto *const p = v->rd[(addr >> 8) & 0xFF];
+   return p ? p[addr & 0xFF] : 0xFF;
+}
+
+void Poke6502(Virtual_6502 *v6502, int addr, int value)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   SharedWriter const writer(v);
+   v->poke(addr, value);
+}
+
+// State files
+//
+// All numbers are little endian. The file starts with a 64 byte header:
+//
+//    0  8  magic "V6502ST" followed by 0x1A
+//    8  2  version, currently 1; files with a higher version are rejected
+//   10  2  flags, bit 0: a 64K memory image is present
+//   12  4  offset of the memory image, a multiple of 4096 so that it can
+//          be mapped directly as the address space
+//   16  4  offset of the page records
+//   20  4  size in bytes of the page records
+//   24  2  PC
+//   26  5  A, X, Y, S, P
+//   31  1  CPU variant, 0: NMOS 6502, 1: 65C02
+//   32  4  special range begin (0x0000->0x10000)
+//   36  4  special range end+1
+//   40  4  ROM begin, 0x10000 when there is no ROM
+//   44  4  reserved, 0
+//   48  8  cycle
+//   56  8  reserved, 0
+//
+// Memory starts as the image, or filled with 0xFF without one, and every
+// page record then replaces a page:
+//
+//    0  1  page
+//    1  1  encoding, 0: 256 raw bytes, 1: PackBits
+//    2  2  size of the data
+//    4     data
+//
+// A file without the magic holding 6+64K bytes is the old apple2.img
+// dump: A, X, Y, S, P as a 2 byte value and the memory, ROM at $C000.
+
+enum {
+   state_version    =  1,
+   state_header     =  64,
+   state_image      =  4096,   // offset of the memory image
+   state_has_image  =  0x01,
+   legacy_size      =  6 + 65536
+};
+
+static const char state_magic[8] = {'V','6','5','0','2','S','T',0x1A};
+
+static void put16(unsigned char *p, int v) { p[0] = v; p[1] = v >> 8; }
+static void put32(unsigned char *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+static int get16(const unsigned char *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const unsigned char *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+static int PackBits(const unsigned char *src, unsigned char *dst)
+{
+   int n = 0;
+   for (int i = 0; i < 256; ) {
+      int run = 1;
+      while (i + run < 256 && run < 128 && src[i + run] == src[i])
+         run++;
+      if (run > 1) {
+         dst[n++] = 257 - run;
+         dst[n++] = src[i];
+         i += run;
+         continue;
+      }
+      // literals up to the next run of 3
+      int len = 1;
+      while (i + len < 256 && len < 128 &&
+             !(i + len + 2 < 256 && src[i + len] == src[i + len + 1] &&
+               src[i + len] == src[i + len + 2]))
+         len++;
+      dst[n++] = len - 1;
+      memcpy(dst + n, src + i, len);
+      n += len;
+      i += len;
+   }
+   return n;
+}
+
+static bool UnpackBits(const unsigned char *src, int size, unsigned char *dst)
+{
+   int n = 0;
+   for (int i = 0; i < size; ) {
+      int const c = src[i++];
+      if (c < 128) {
+         if (n + c + 1 > 256 || i + c + 1 > size)
+            return false;
+         memcpy(dst + n, src + i, c + 1);
+         n += c + 1;
+         i += c + 1;
+      } else if (c > 128) {
+         if (n + 257 - c > 256 || i >= size)
+            return false;
+         memset(dst + n, src[i++], 257 - c);
+         n += 257 - c;
+      }
+   }
+   return n == 256;
+}
+
+// memory and legacy fields as seen by a state file
+static void StateMemory(Virtual_6502 *v6502, unsigned char *mem, long range[3])
+{
+   if (auto *const as = v6502->address_space) {
+      memcpy(mem, as, 65536);
+      range[0] = v6502->special_start - as;
+      range[1] = v6502->special_end - as;
+      range[2] = v6502->rom_start - as;
+   } else {
+      for (int addr = 0; addr < 65536; addr++)
+         mem[addr] = Peek6502(v6502, addr);
+      range[0] = range[1] = 0;
+      range[2] = 0x10000;
+   }
+}
+
+// writes a whole state file to a temporary file renamed over path, so that
+// an instance mapping the image of the old file, even the one being saved,
+// keeps its pages instead of losing them to the truncation
+static bool ReplaceFile(const char *path, std::initializer_list<std::pair<const void*, size_t>> parts)
+{
+   std::string const tmp = std::string(path) + ".tmp";
+   FILE *const f = fopen(tmp.c_str(), "wb");
+   if (!f)
+      return false;
+   bool ok = true;
+   for (auto const &p : parts)
+      ok = ok && fwrite(p.first, 1, p.second, f) == p.second;
+   ok = !fclose(f) && ok;
+#ifndef HAVE_MMAP
+   // rename doesn't replace an existing file everywhere
+   if (ok)
+      remove(path);
+#endif
+   if (!ok || rename(tmp.c_str(), path)) {
+      remove(tmp.c_str());
+      return false;
+   }
+   return true;
+}
+
+bool SaveFile6502(Virtual_6502 *v6502, const char *path, int flags)
+{
+   std::unique_ptr<unsigned char[]> mem{new unsigned char[65536]};
+   long range[3];
+   StateMemory(v6502, mem.get(), range);
+
+   unsigned char header[state_header] = {};
+   memcpy(header, state_magic, sizeof state_magic);
+   put16(header + 8, state_version);
+   put16(header + 24, v6502->PC);
+   header[26] = v6502->A;
+   header[27] = v6502->X;
+   header[28] = v6502->Y;
+   header[29] = v6502->S;
+   header[30] = v6502->P;
+   header[31] = v6502->cpu;
+   put32(header + 32, range[0]);
+   put32(header + 36, range[1]);
+   put32(header + 40, range[2]);
+   put32(header + 48, v6502->cycle);
+   put32(header + 52, v6502->cycle >> 32);
+
+   if (flags & V6502_STATE_SPARSE) {
+      // records for the pages that are not blank
+      std::vector<unsigned char> records;
+      unsigned char packed[512];
+      for (int page = 0; page < 256; page++) {
+         const unsigned char *const src = mem.get() + page*256;
+         if (std::all_of(src, src + 256, [](unsigned char c){ return c == 0xFF; }))
+            continue;
+         int const size = PackBits(src, packed);
+         bool const raw = size >= 256;
+         unsigned char rec[4] = {(unsigned char)page, (unsigned char)!raw};
+         put16(rec + 2, raw ? 256 : size);
+         records.insert(records.end(), rec, rec + 4);
+         records.insert(records.end(), raw ? src : packed, raw ? src + 256 : packed + size);
+      }
+      put32(header + 16, state_header);
+      put32(header + 20, records.size());
+      return ReplaceFile(path, {{header, state_header}, {records.data(), records.size()}});
+   }
+
+   put16(header + 10, state_has_image);
+   put32(header + 12, state_image);
+   put32(header + 16, state_image + 65536);
+
+   // an existing file with an image only gets the changed pages rewritten
+   FILE *f = fopen(path, "r+b");
+   if (f) {
+      unsigned char old[state_header];
+      if (fread(old, 1, state_header, f) != state_header ||
+          memcmp(old, state_magic, sizeof state_magic) || get16(old + 8) != state_version ||
+          !(get16(old + 10) & state_has_image) || get32(old + 12) != state_image) {
+         fclose(f);
+         f = nullptr;
+      }
+   }
+   if (f) {
+      unsigned char page[256];
+      bool ok = true;
+      for (int i = 0; i < 256 && ok; i++) {
+         ok = !fseek(f, state_image + i*256, SEEK_SET) && fread(page, 1, 256, f) == 256;
+         if (ok && memcmp(page, mem.get() + i*256, 256))
+            ok = !fseek(f, state_image + i*256, SEEK_SET) &&
+                  fwrite(mem.get() + i*256, 1, 256, f) == 256;
+      }
+      ok = ok && !fseek(f, 0, SEEK_SET) && fwrite(header, 1, state_header, f) == state_header;
+      return !fclose(f) && ok;
+   }
+
+   static const unsigned char pad[state_image - state_header] = {};
+   return ReplaceFile(path, {{header, state_header}, {pad, sizeof pad}, {mem.get(), 65536}});
+}
+
+// maps the image of a state file as the address space, NULL if unsupported
+static unsigned char *MapImage(const char *path, long offset)
+{
+#ifdef HAVE_MMAP
+   int const fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return {};
+   void *const p = mmap(nullptr, 65536, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+   close(fd);
+   if (p != MAP_FAILED)
+      return (unsigned char *)p;
+#endif
+   return {};
+}
+
+Virtual_6502 *LoadFile6502(const char *path, int engine)
+{
+   FILE *const f = fopen(path, "rb");
+   if (!f)
+      return {};
+   std::unique_ptr<FILE, int(*)(FILE*)> closer{f, fclose};
+   unsigned char header[state_header];
+   size_t const n = fread(header, 1, state_header, f);
+
+   if (n < state_header || memcmp(header, state_magic, sizeof state_magic)) {
+      // the old apple2.img dump
+      if (fseek(f, 0, SEEK_END) || ftell(f) != legacy_size || fseek(f, 0, SEEK_SET))
+         return {};
+      auto *const v6502 = New6502(engine);
+      unsigned char regs[6];
+      if (!v6502 || fread(regs, 1, 6, f) != 6 ||
+          fread(v6502->address_space, 1, 65536, f) != 65536) {
+         if (v6502)
+            Free6502(v6502);
+         return {};
+      }
+      v6502->A = regs[0];
+      v6502->X = regs[1];
+      v6502->Y = regs[2];
+      v6502->S = regs[3];
+      v6502->P = get16(regs + 4);
+      v6502->rom_start = v6502->address_space + 0xC000;
+      // the dump has no PC, start from the reset vector
+      v6502->PC = get16(v6502->address_space + 0xFFFC);
+      return v6502;
+   }
+
+   if (get16(header + 8) > state_version)
+      return {};
+   int const flags = get16(header + 10);
+   uint32_t const image = get32(header + 12);
+   uint32_t const records = get32(header + 16), records_size = get32(header + 20);
+   uint32_t const range[3] = {get32(header + 32), get32(header + 36), get32(header + 40)};
+   for (uint32_t r : range)
+      if (r > 0x10000)
+         return {};
+   if (fseek(f, 0, SEEK_END))
+      return {};
+   long const size = ftell(f);
+   if ((flags & state_has_image) && (size < 65536 || image > size - 65536 || image % 4096))
+      return {};
+   if (records > size || records_size > size - records)
+      return {};
+
+   V6502 *v6502;
+   unsigned char *mem = (flags & state_has_image) ? MapImage(path, image) : nullptr;
+   if (mem) {
+      v6502 = Alloc6502(engine, 0);
+      if (!v6502) {
+#ifdef HAVE_MMAP
+         munmap(mem, 65536);
+#endif
+         return {};
+      }
+      v6502->image_mapped = true;
+   } else {
+      v6502 = Alloc6502(engine, 65536);
+      if (!v6502)
+         return {};
+      mem = (unsigned char *)(v6502+1);
+      if (flags & state_has_image) {
+         if (fseek(f, image, SEEK_SET) || fread(mem, 1, 65536, f) != 65536) {
+            Free6502(v6502);
+            return {};
+         }
+      } else
+         memset(mem, 0xFF, 65536);
+   }
+
+   std::vector<unsigned char> data(records_size);
+   bool ok = !fseek(f, records, SEEK_SET) && fread(data.data(), 1, data.size(), f) == data.size();
+   for (size_t i = 0; ok && i + 4 <= data.size(); ) {
+      int const page = data[i], encoding = data[i+1], size = get16(&data[i+2]);
+      i += 4;
+      if (i + size > data.size())
+         ok = false;
+      else if (encoding == 1)
+         ok = UnpackBits(&data[i], size, mem + page*256);
+      else if (encoding == 0 && size == 256)
+         memcpy(mem + page*256, &data[i], 256);
+      else
+         ok = false;
+      i += size;
+   }
+   if (!ok) {
+      Free6502(v6502);
+      return {};
+   }
+
+   Attach6502(v6502, mem);
+   v6502->special_start = mem + range[0];
+   v6502->special_end = mem + range[1];
+   v6502->rom_start = mem + range[2];
+   v6502->PC = get16(header + 24);
+   v6502->A = header[26];
+   v6502->X = header[27];
+   v6502->Y = header[28];
+   v6502->S = header[29];
+   v6502->P = header[30];
+   v6502->cpu = header[31] == V6502_65C02 ? V6502_65C02 : V6502_NMOS;
+   v6502->cycle = get32(header + 48) | (long long)get32(header + 52) << 32;
+   return v6502;
+}
+
+void V6502::map(int page, unsigned char *read, unsigned char *write, IOPage handlers)
+{
+   if (trap[page] & trap_code)
+      code_written(page);
+   Page::release(pages[page]);
+   pages[page] = nullptr;
+   trap[page] &= ~trap_cow;
+   if (read != rd[page] || write != ram[page])
+      mark_dirty(page);
+   rd[page] = read;
+   ram[page] = write;
+   io[page] = handlers;
+   update_page(page);
+   if (page == code_page)
+      code_page = -1;
+}
+
+void V6502::map_shared(int page, Page *storage, bool writable)
+{
+   auto *const p = Page::ref(storage);
+   map(page, p->data, writable ? p->data : nullptr, {});
+   pages[page] = p;
+   if (writable) {
+      trap[page] |= trap_cow;
+      update_page(page);
+   }
+}
+
+// Builds the pages not mapped through the API from special_start,
+// special_end and rom_start. Pages holding any special address, or the
+// ROM boundary, go through legacy_read/legacy_write; the others map
+// address_space directly.
+void V6502::map_legacy()
+{
+   if (!address_space)
+      return;
+   for (int page = 0; page < 256; page++)
+      if (!mapped[page])
+         map_legacy(page);
+   map_special_start = special_start;
+   map_special_end = special_end;
+   map_rom_start = rom_start;
+}
+
+void V6502::map_legacy(int page)
+{
+   unsigned char *const base = address_space + page*256;
+   if ((base < special_end && base+256 > special_start) ||
+       (base < rom_start && base+256 > rom_start))
+      map(page, nullptr, nullptr, {legacy_read, legacy_write, nullptr});
+   else
+      map(page, base, base < rom_start ? base : nullptr, {});
+}
+
+int V6502::legacy_read(Virtual_6502 *v, int addr, void *)
+{
+   unsigned char *const ea = v->address_space + addr;
+   if (ea < v->special_start || ea >= v->special_end)
+      return *ea;
+   v->special_ea = ea;
+   if (static_cast<V6502*>(v)->profiling)
+      static_cast<V6502*>(v)->profile->io_reads[addr]++;
+   v->special_read(v, v->special_user);
+   if (auto *const log = static_cast<V6502*>(v)->rewind)
+      log->push(0x80000000u | *ea << 16 | addr);
+   return *ea = v->special_value;
+}
+
+void V6502::legacy_write(Virtual_6502 *v, int addr, int value, void *)
+{
+   unsigned char *const ea = v->address_space + addr;
+   if (ea < v->special_start || ea >= v->special_end) {
+      if (ea < v->rom_start) {
+         if (auto *const log = static_cast<V6502*>(v)->rewind)
+            log->push(0x80000000u | *ea << 16 | addr);
+         static_cast<V6502*>(v)->mark_dirty(addr >> 8);
+         *ea = value;
+      }
+   } else {
+      if (static_cast<V6502*>(v)->profiling)
+         static_cast<V6502*>(v)->profile->io_writes[addr]++;
+      v->special_ea = ea;
+      v->special_value = value;
+      v->special_write(v, v->special_user);
+   }
+}
+
 int Execute6502(Virtual_6502 *v6502, int nticks)
 {
    v6502->ticks = nticks;
-   static_cast<V6502*>(v6502)->execute();
-   return nticks+v6502->ticks;
+   v6502->stop = V6502_BUDGET;
+   auto *const v = static_cast<V6502*>(v6502);
+   {
+      SharedWriter const writer(v);
+      v->tick_base = v->cycle + nticks;
+      v->running = true;
+      v->execute();
+      v->running = false;
+      v6502->cycle += nticks-v6502->ticks;
+   }
+   return nticks-v6502->ticks;
+}
+
+// The remaining ticks are put aside and replaced by stop_bias; ticks
+// refunded by a cut short block are still counted when they are restored.
+void Stop6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (v->stop == V6502_STOPPED)
+      return;
+   v->stop = V6502_STOPPED;
+   v->stop_ticks = v->ticks;
+   v->ticks = V6502::stop_bias;
+   if (v->cache && v->cache->running)
+      v->blk_end = v->cur + 1;
+}
+
+int Schedule6502(Virtual_6502 *v6502, long long cycle, Event6502 fn, void *user)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (!v->events)
+      v->events = new EventQueue{};
+   int const id = v->events->push(cycle, fn, user);
+   v->shorten_slice(cycle);
+   return id;
+}
+
+bool Cancel6502(Virtual_6502 *v6502, int id)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   return v->events && v->events->cancel(id);
+}
+
+void IRQ6502(Virtual_6502 *v6502, unsigned sources, bool asserted)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (!asserted) {
+      v->irq_lines &= ~sources;
+      return;
+   }
+   v->irq_lines |= sources;
+   v->irq_unmasked();
 }
 
+void NMI6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   v->nmi_pending = true;
+   v->shorten_slice(v->tick_base - v->ticks);
+}
+
+void Reset6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   v->reset_pending = true;
+   v->shorten_slice(v->tick_base - v->ticks);
+}
+
+void SkipIdle6502(Virtual_6502 *v6502, bool enable)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   v->idle_disarm();
+   v->skip_idle = enable;
+}
+
+void DirtyPages6502(Virtual_6502 *v6502, unsigned char dirty[32])
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (v->dirty_tracking)
+      memcpy(dirty, v->dirty, sizeof v->dirty);
+   else
+      memset(dirty, 0xFF, sizeof v->dirty);
+   v->dirty_tracking = true;
+   memset(v->dirty, 0, sizeof v->dirty);
+   for (int page = 0; page < 256; page++)
+      if (v->ram[page]) {
+         v->trap[page] |= trap_dirty;
+         v->update_page(page);
+      }
+}
+
+long long Cycle6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (!v->running)
+      return v->cycle;
+   if (v->timed)
+      return v->access_cycle;
+   int ticks = v->ticks;
+   if (v->stop == V6502_STOPPED && ticks < V6502::stop_bias / 2)
+      ticks = v->stop_ticks + (ticks - V6502::stop_bias);
+   return v->tick_base - ticks;
+}
+
+template <class Cpu>
 std::array<JumpEntry, 256> JumpTableInit() {
    std::array<JumpEntry, 256> op;
-   using V = V6502;
    op.fill(&V6502::op_illegal);
 
-#define defop1(oper,cycles,operation,addrmode) \
-   def<&V6502::op_##operation, &V6502::lea_##addrmode>(op[0x##oper], cycles)
-
 #define defop(oper,cycles,operation,addrmode) \
    (op[0x##oper] = &V6502::op_impl<cycles, &V6502::op_##operation, &V6502::lea_##addrmode>)
 
-   defop(00,7,brk,abs);
-   defop(10,2,bpl,rel);
-   defop(20,6,jsr,abs);
-   defop(30,2,bmi,rel);
-   defop(40,6,rti,nop);
-   defop(50,2,bvc,rel);
-   defop(60,6,rts,nop);
-   defop(70,2,bvs,rel);
-   defop(90,2,bcc,rel);
-   defop(A0,2,ldyimm,nop);
-   defop(B0,2,bcs,rel);
-   defop(C0,2,cpyimm,nop);
-   defop(D0,2,bne,rel);
-   defop(E0,2,cpximm,nop);
-   defop(F0,2,beq,rel);
-
-   defop(01,4,ora,zpxi);
-   defop(11,3,ora,zpiy);
-   defop(21,4,and,zpxi);
-   defop(31,3,and,zpiy);
-   defop(41,4,eor,zpxi);
-   defop(51,3,eor,zpiy);
-   defop(61,4,adc,zpxi);
-   defop(71,3,adc,zpiy);
-   defop(81,4,sta,zpxi);
-   defop(91,3,sta,zpiy);
-   defop(A1,4,lda,zpxi);
-   defop(B1,3,lda,zpiy);
-   defop(C1,4,cmp,zpxi);
-   defop(D1,3,cmp,zpiy);
-   defop(E1,4,sbc,zpxi);
-   defop(F1,3,sbc,zpiy);
-
-   defop(A2,2,ldximm,nop);
-
-   defop(24,3,bit,zp);
-   defop(84,3,sty,zp);
-   defop(94,4,sty,zpx);
-   defop(A4,3,ldy,zp);
-   defop(B4,4,ldy,zpx);
-   defop(C4,3,cpy,zp);
-   defop(E4,3,cpx,zp);
-
-   defop(05,3,ora,zp);
-   defop(15,4,ora,zpx);
-   defop(25,3,and,zp);
-   defop(35,4,and,zpx);
-   defop(45,3,eor,zp);
-   defop(55,4,eor,zpx);
-   defop(65,3,adc,zp);
-   defop(75,4,adc,zpx);
-   defop(85,3,sta,zp);
-   defop(95,4,sta,zpx);
-   defop(A5,3,lda,zp);
-   defop(B5,4,lda,zpx);
-   defop(C5,3,cmp,zp);
-   defop(D5,4,cmp,zpx);
-   defop(E5,3,sbc,zp);
-   defop(F5,4,sbc,zpx);
-
-   defop(06,5,asl,zp);
-   defop(16,6,asl,zpx);
-   defop(26,5,rol,zp);
-   defop(36,6,rol,zpx);
-   defop(46,5,lsr,zp);
-   defop(56,6,lsr,zpx);
-   defop(66,5,ror,zp);
-   defop(76,6,ror,zpx);
-   defop(86,4,stx,zp);
-   defop(96,3,stx,zpy);
-   defop(A6,4,ldx,zp);
-   defop(B6,3,ldx,zpy);
-   defop(C6,5,dec,zp);
-   defop(D6,6,dec,zpx);
-   defop(E6,5,inc,zp);
-   defop(F6,6,inc,zpx);
-
-   defop(08,3,php,nop);
-   defop(18,2,clc,nop);
-   defop(28,4,plp,nop);
-   defop(38,2,sec,nop);
-   defop(48,3,pha,nop);
-   defop(58,2,cli,nop);
-   defop(68,4,pla,nop);
-   defop(78,2,sei,nop);
-   defop(88,2,dey,nop);
-   defop(98,2,tya,nop);
-   defop(A8,2,tay,nop);
-   defop(B8,2,clv,nop);
-   defop(C8,2,iny,nop);
-   defop(D8,2,cld,nop);
-   defop(E8,2,inx,nop);
-   defop(F8,2,sed,nop);
-
-   defop(09,2,oraimm,nop);
-   defop(19,4,ora,absy);
-   defop(29,2,andimm,nop);
-   defop(39,4,and,absy);
-   defop(49,2,eorimm,nop);
-   defop(59,4,eor,absy);
-   defop(69,2,adcimm,nop);
-   defop(79,4,adc,absy);
-   defop(99,4,sta,absy);
-   defop(A9,2,ldaimm,nop);
-   defop(B9,4,lda,absy);
-   defop(C9,2,cmpimm,nop);
-   defop(D9,4,cmp,absy);
-   defop(E9,2,sbcimm,nop);
-   defop(F9,4,sbc,absy);
-
-   defop(0A,2,asla,nop);
-   defop(2A,2,rola,nop);
-   defop(4A,2,lsra,nop);
-   defop(6A,2,rora,nop);
-   defop(8A,2,txa,nop);
-   defop(9A,2,txs,nop);
-   defop(AA,2,tax,nop);
-   defop(BA,2,tsx,nop);
-   defop(CA,2,dex,nop);
-   defop(EA,2,nop,nop);
-
-   defop(2C,4,bit,abs);
-   defop(4C,3,jmp,abs);
-   defop(6C,5,jmp,absi);
-   defop(8C,4,sty,abs);
-   defop(AC,4,ldy,abs);
-   defop(BC,4,ldy,absx);
-   defop(CC,4,cpy,abs);
-   defop(EC,4,cpx,abs);
-
-   defop(0D,4,ora,abs);
-   defop(1D,4,ora,absx);
-   defop(2D,4,and,abs);
-   defop(3D,4,and,absx);
-   defop(4D,4,eor,abs);
-   defop(5D,4,eor,absx);
-   defop(6D,4,adc,abs);
-   defop(7D,4,adc,absx);
-   defop(8D,4,sta,abs);
-   defop(9D,4,sta,absx);
-   defop(AD,4,lda,abs);
-   defop(BD,4,lda,absx);
-   defop(CD,4,cmp,abs);
-   defop(DD,4,cmp,absx);
-   defop(ED,4,sbc,abs);
-   defop(FD,4,sbc,absx);
-
-   defop(0E,4,asl,abs);
-   defop(1E,4,asl,absx);
-   defop(2E,4,rol,abs);
-   defop(3E,4,rol,absx);
-   defop(4E,4,lsr,abs);
-   defop(5E,4,lsr,absx);
-   defop(6E,4,ror,abs);
-   defop(7E,4,ror,absx);
-   defop(8E,4,stx,abs);
-   defop(AE,4,ldx,abs);
-   defop(BE,4,ldx,absy);
-   defop(CE,6,dec,abs);
-   defop(DE,6,dec,absx);
-   defop(EE,6,inc,abs);
-   defop(FE,6,inc,absx);
+#include "asm_6502_ops.h"
+   if (Cpu::cmos) {
+#include "asm_6502_ops_65c02.h"
+   } else {
+#include "asm_6502_ops_nmos.h"
+   }
 #undef defop
 
    return op;
 }
 
-const std::array<JumpEntry, 256> JumpTable = JumpTableInit();
+template <class Cpu>
+const std::array<JumpEntry, 256> JumpTable = JumpTableInit<Cpu>();
 
-void V6502::execute()
+// Decoding information for the translation cache
+
+struct PreDecode {
+   BlockEntry fn;
+   uint8_t cycles;
+   uint8_t size;        // operand bytes
+   bool rel;            // operand is a relative branch target
+   bool last;           // instruction ends a basic block
+};
+
+static int operandSize(const char *operation, const char *addrmode)
 {
-   ea = address_space;
-   pc = address_space + PC;
-   stk = address_space + 0x100 + S;
-   flags = P;
+   if (!strcmp(addrmode, "nop"))
+      return strstr(operation, "imm") ? 1 : 0;
+   return (!strcmp(addrmode, "abs") || !strcmp(addrmode, "absx") ||
+           !strcmp(addrmode, "absy") || !strcmp(addrmode, "absi") ||
+           !strcmp(addrmode, "ind") || !strcmp(addrmode, "absxi") ||
+           !strcmp(addrmode, "zprel")) ? 2 : 1;
+}
+
+static bool endsBlock(const char *operation, const char *addrmode)
+{
+   static const char *const jumps[] = {"jmp", "jsr", "rts", "rti", "brk<Cpu>", "wai"};
+   if (!strcmp(addrmode, "rel") || !strcmp(addrmode, "zprel"))
+      return true;
+   for (auto *j : jumps)
+      if (!strcmp(operation, j))
+         return true;
+   return false;
+}
+
+template <class Cpu>
+std::array<PreDecode, 256> PreDecodeInit() {
+   std::array<PreDecode, 256> op{};
+
+#define defop(oper,cycles,operation,addrmode) \
+   (op[0x##oper] = {&V6502::op_pre<&V6502::op_##operation, &V6502::pre_##addrmode>, cycles, \
+                    (uint8_t)operandSize(#operation, #addrmode), !strcmp(#addrmode, "rel"), \
+                    endsBlock(#operation, #addrmode)})
+
+#include "asm_6502_ops.h"
+   if (Cpu::cmos) {
+#include "asm_6502_ops_65c02.h"
+   } else {
+#include "asm_6502_ops_nmos.h"
+   }
+#undef defop
+
+   return op;
+}
+
+template <class Cpu>
+const std::array<PreDecode, 256> PreDecodeTable = PreDecodeInit<Cpu>();
+
+// a block ends after a jump or branch, before an illegal opcode, or when
+// it would reach a page that can't be read directly
+Block *BlockCache::translate(V6502 &v, uint16_t addr)
+{
+   enum { max_insns = 64 };
+   std::unique_ptr<Block> blk{new Block{}};
+   blk->start = addr;
+   int end = addr;
+   auto const peek = [&](int a) { return v.rd[a >> 8][a & 0xFF]; };
+   auto const &table = v.cpu == V6502_65C02 ? PreDecodeTable<WDC65C02> : PreDecodeTable<NMOS6502>;
+   for (int i = 0; i < max_insns; i++) {
+      if (!v.rd[end >> 8])
+         break;
+      auto const &d = table[peek(end)];
+      if (!d.fn || end + 1 + d.size > 0x10000 || !v.rd[(end + d.size) >> 8])
+         break;
+      BlockInsn insn{d.fn, 0, d.cycles};
+      if (d.size == 2)
+         insn.operand = V6502::make_u16(peek(end+1), peek(end+2));
+      else if (d.size == 1)
+         insn.operand = peek(end+1);
+      if (d.rel)
+         insn.operand = end + 2 + (int8_t)insn.operand;
+      blk->insns.push_back(insn);
+      blk->cycles += d.cycles;
+      end += 1 + d.size;
+      if (d.last)
+         break;
+   }
+   if (blk->insns.empty())
+      return nullptr;
+   blk->head = blk->cycles - blk->insns.back().cycles;
+   blk->first_page = addr >> 8;
+   blk->last_page = (end - 1) >> 8;
+   for (int p = blk->first_page; p <= blk->last_page; p++) {
+      code[p].push_back(blk.get());
+      v.trap[p] |= trap_code;
+      v.update_page(p);
+   }
+   auto &page = start[addr >> 8];
+   if (!page)
+      page.reset(new std::unique_ptr<Block>[256]);
+   return (page[addr & 0xFF] = std::move(blk)).get();
+}
+
+// drops all blocks with code on the page, returns true if the running
+// block was one of them
+bool BlockCache::invalidate(int page)
+{
+   bool hit = false;
+   auto blocks = std::move(code[page]);
+   code[page].clear();
+   for (auto *blk : blocks) {
+      for (int p = blk->first_page; p <= blk->last_page; p++) {
+         auto &c = code[p];
+         c.erase(std::remove(c.begin(), c.end(), blk), c.end());
+      }
+      hit |= blk == running;
+      retired.push_back(std::move(start[blk->start >> 8][blk->start & 0xFF]));
+   }
+   return hit;
+}
+
+void V6502::load_registers()
+{
+   // PC moved from the outside: no longer on a WAI
+   if (pc != PC)
+      waiting = false;
+   // memory may have changed from the outside
+   idle_disarm();
+   pc = PC;
+   s = S;
+   set_flags(P);
    a = A;
    x = X;
    y = Y;
+}
+
+void V6502::store_registers()
+{
+   S = s;
+   PC = pc;
+   P = get_flags();
+   A = a;
+   X = x;
+   Y = y;
+}
 
-   while (ticks != 0 && flags != 0) {
-      auto fun = JumpTable[fetch()];
+void V6502::execute()
+{
+   if (special_start != map_special_start || special_end != map_special_end ||
+       rom_start != map_rom_start)
+      map_legacy();
+
+   ea = 0;
+   code_page = -1;
+   load_registers();
+
+   exact = engine == V6502_EXACT && (rewind || !profiling);
+   run_slices();
+
+   if (stop == V6502_STOPPED)
+      ticks = stop_ticks + (ticks - stop_bias);
+   store_registers();
+}
+
+// Runs the engine in slices ending at the next event, or at the next
+// checkpoint when recording the journal; the events due run in between
+// with the registers stored.
+void V6502::run_slices()
+{
+   for (;;) {
+      while (stop == V6502_BUDGET && events && events->due(tick_base - ticks)) {
+         auto const e = events->pop();
+         store_registers();
+         e.fn(this, e.cycle, e.user);
+         load_registers();
+      }
+      ticks += slice_rest;
+      tick_base += slice_rest;
+      slice_rest = 0;
+      if (ticks <= 0 || stop != V6502_BUDGET)
+         break;
+      take_interrupt();
+
+      long long const now = tick_base - ticks;
+      long long limit = ticks;
+      if (events && !events->heap.empty())
+         limit = std::min(limit, events->heap.front().cycle - now);
+      if (rewind) {
+         rewind->checkpoint(now);
+         limit = std::min<long long>(limit, rewind->interval);
+      }
+      slice_rest = ticks - (int)limit;
+      ticks -= slice_rest;
+      tick_base -= slice_rest;
+      run_engine();
+   }
+}
+
+void V6502::run_engine()
+{
+   if (cpu == V6502_65C02)
+      run_engine<WDC65C02>();
+   else
+      run_engine<NMOS6502>();
+}
+
+template <class Cpu>
+void V6502::run_engine()
+{
+   if (rewind) {
+      if (exact)
+         run_switch<Cpu, true, true>();
+      else
+         run_switch<Cpu, true, false>();
+   }
+   else if (profiling)
+      run_table<Cpu, true>();
+   else if (engine == V6502_SWITCH)
+      run_switch<Cpu, false, false>();
+   else if (engine == V6502_EXACT)
+      run_switch<Cpu, false, true>();
+   else if (engine == V6502_CACHED)
+      run_cached<Cpu>();
+   else
+      run_table<Cpu, false>();
+}
+
+// adds the registers before an instruction or interrupt to the journal
+void V6502::record()
+{
+   rewind->push(pc | (uint32_t)a << 16 | (uint32_t)x << 24);
+   rewind->push(y | s << 8 | get_flags() << 16 | (uint32_t)((tick_base - ticks) & 0x7F) << 24);
+}
+
+// RESET, NMI or an unmasked IRQ, 7 ticks each; RESET does not write the
+// stack, the 65C02 clears D
+void V6502::take_interrupt()
+{
+   if (!reset_pending && !nmi_pending && !(irq_lines && !(flags & f_interrupt)))
+      return;
+   if (rewind)
+      record();
+   idle_disarm();
+   if (waiting) {
+      waiting = false;
+      pc++;
+   }
+   if (reset_pending) {
+      reset_pending = false;
+      s -= 3;
+      flags |= f_interrupt;
+      pc = mreadw(0xFFFC);
+   } else if (nmi_pending) {
+      nmi_pending = false;
+      interrupt(0xFFFA, 0);
+   } else
+      interrupt(0xFFFE, 0);
+   if (cpu == V6502_65C02)
+      flags &= ~f_decimal;
+   ticks -= 7;
+}
+
+// an event was scheduled before the end of the running slice: put the
+// ticks after it aside
+void V6502::shorten_slice(long long cycle)
+{
+   if (!running || stop != V6502_BUDGET || ticks <= 0 || cycle >= tick_base)
+      return;
+   int const shift = (int)std::min<long long>(tick_base - cycle, ticks);
+   ticks -= shift;
+   tick_base -= shift;
+   slice_rest += shift;
+}
+
+template <class Cpu, bool Profile>
+void V6502::run_table()
+{
+   while (ticks > 0) {
+      uint16_t const at = pc;
+      int const before = ticks;
+      uint8_t const opcode = fetch();
+      auto fun = JumpTable<Cpu>[opcode];
       if (fun == &V6502::op_illegal) {
-         ticks |= 0x800000;
+         stop = V6502_ILLEGAL;
          break;
       }
       (*this.*fun)();
+      if (Profile) {
+         auto &prof = *profile;
+         int const spent = before - (stop == V6502_STOPPED ? stop_ticks : ticks);
+         prof.op_count[opcode]++;
+         prof.op_ticks[opcode] += spent;
+         prof.pc_count[at]++;
+         prof.pc_ticks[at] += spent;
+         prof.nodes[prof.node].ticks += spent;
+         if (opcode == 0x20 || opcode == 0x00)
+            prof.enter(pc, s);
+         else if (opcode == 0x60 || opcode == 0x40)
+            prof.leave(s);
+      }
    }
+}
 
-   S = (uintptr_t)stk  & 0xFF;
-   PC = pc_val();
-   P = flags ;
-   A = a;
-   X = x;
-   Y = y;
+// the opcodes of the variant are switched on in the default case of the
+// shared ones
+template <class Cpu, bool Record, bool Exact>
+void V6502::run_switch()
+{
+   while (ticks > 0) {
+      if (Record) {
+         record();
+      }
+      uint8_t const opcode = fetch();
+      switch (opcode) {
+#define defop(oper,cycles,operation,addrmode) \
+      case 0x##oper: \
+         if (Exact) \
+            op_exact<cycles, &V6502::op_##operation, &V6502::lea_##addrmode, \
+                     timing_of(#operation, #addrmode, cycles)>(); \
+         else \
+            op_impl<cycles, &V6502::op_##operation, &V6502::lea_##addrmode>(); \
+         break
+
+#include "asm_6502_ops.h"
+
+      default:
+         if (Cpu::cmos) {
+            switch (opcode) {
+#include "asm_6502_ops_65c02.h"
+            default:
+               stop = V6502_ILLEGAL;
+               return;
+            }
+         } else {
+            switch (opcode) {
+#include "asm_6502_ops_nmos.h"
+            default:
+               stop = V6502_ILLEGAL;
+               return;
+            }
+         }
+      }
+#undef defop
+   }
+}
+
+template <class Cpu>
+void V6502::run_cached()
+{
+   while (ticks > 0) {
+      auto *blk = cache->find(pc);
+      if (!blk)
+         blk = cache->translate(*this, pc);
+      if (!blk) {
+         auto fun = JumpTable<Cpu>[fetch()];
+         if (fun == &V6502::op_illegal) {
+            stop = V6502_ILLEGAL;
+            break;
+         }
+         (*this.*fun)();
+         continue;
+      }
+      cache->running = blk;
+      auto *const begin = blk->insns.data();
+      auto *const end = begin + blk->insns.size();
+      blk_end = end;
+      if (ticks > blk->head) {
+         // the whole block runs, charge it at once
+         ticks -= blk->cycles;
+         for (cur = begin; cur != blk_end; ++cur) {
+            pc++;
+            cur->fn(this);
+         }
+         // refund the instructions skipped after a write to the block
+         for (auto *i = cur; i != end; ++i)
+            ticks += i->cycles;
+      } else {
+         for (cur = begin; cur != blk_end && ticks > 0; ++cur) {
+            ticks -= cur->cycles;
+            pc++;
+            cur->fn(this);
+         }
+      }
+      cache->running = nullptr;
+   }
+   cache->retired.clear();
+}
+
+// undoes the last instruction in the journal
+bool V6502::step_back()
+{
+   auto &log = *rewind;
+   while (log.head > log.tail) {
+      uint32_t const w = log.pop();
+      if (w & 0x80000000u) {
+         uint16_t const addr = w;
+         if (ram[addr >> 8])
+            poke(addr, w >> 16);
+         else if (address_space) {
+            mark_dirty(addr >> 8);
+            address_space[addr] = w >> 16;
+         }
+         continue;
+      }
+      uint32_t const r = log.pop();
+      PC = r & 0xFFFF;
+      A = r >> 16 & 0xFF;
+      X = r >> 24;
+      Y = w & 0xFF;
+      S = w >> 8 & 0xFF;
+      P = w >> 16 & 0xFF;
+      cycle -= (cycle - (w >> 24)) & 0x7F;
+      while (!log.checkpoints.empty() && log.checkpoints.back().pos > log.head)
+         log.checkpoints.pop_back();
+      return true;
+   }
+   return false;
+}
+
+void Rewind6502(Virtual_6502 *v6502, int size)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   delete v->rewind;
+   v->rewind = nullptr;
+   if (size > 0) {
+      size_t words = 1024;
+      while (words * 2 <= (size_t)size / 4)
+         words *= 2;
+      v->rewind = new RewindLog{};
+      v->rewind->ring.resize(words);
+      v->rewind->mask = words - 1;
+      v->rewind->interval = words / 16;
+   }
+   for (int page = 0; page < 256; page++) {
+      if (v->rewind)
+         v->trap[page] |= trap_journal;
+      else
+         v->trap[page] &= ~trap_journal;
+      v->update_page(page);
+   }
+}
+
+bool StepBack6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   SharedWriter const writer(v);
+   return v->rewind && v->step_back();
+}
+
+bool RunBack6502(Virtual_6502 *v6502, long long cycle)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (!v->rewind || v->rewind->checkpoints.empty() ||
+       v->rewind->checkpoints.front().cycle > cycle)
+      return false;
+   SharedWriter const writer(v);
+   while (v->cycle > cycle && v->step_back())
+      ;
+   return true;
+}
+
+// Profiler
+
+// mnemonic and addressing mode of every opcode, from the opcode table
+struct OpName {
+   std::string mnemonic, mode;
+};
+
+static OpName opName(std::string operation, std::string addrmode)
+{
+   auto const variant = operation.find('<');
+   if (variant != std::string::npos)
+      operation.resize(variant);
+   std::string mode = addrmode == "nop" ? "imp" : addrmode;
+   if (operation.size() > 3 && operation.compare(3, std::string::npos, "imm") == 0)
+      mode = "imm";
+   else if (operation.size() == 4 && operation[3] == 'a')
+      mode = "acc";
+   // RMB0-7, SMB0-7, BBR0-7 and BBS0-7 keep the bit number
+   operation.resize(operation.size() == 4 && isdigit(operation[3]) ? 4 : 3);
+   for (auto &c : operation)
+      c = toupper(c);
+   return {operation, mode};
+}
+
+template <class Cpu>
+static std::array<OpName, 256> OpNameInit()
+{
+   std::array<OpName, 256> op;
+
+#define defop(oper,cycles,operation,addrmode) \
+   (op[0x##oper] = opName(#operation, #addrmode))
+
+#include "asm_6502_ops.h"
+   if (Cpu::cmos) {
+#include "asm_6502_ops_65c02.h"
+   } else {
+#include "asm_6502_ops_nmos.h"
+   }
+#undef defop
+
+   return op;
+}
+
+void Profile6502(Virtual_6502 *v6502, bool enable)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (enable && !v->profile)
+      v->profile = new Profile{};
+   v->profiling = enable;
+}
+
+void ClearProfile6502(Virtual_6502 *v6502)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   if (v->profile)
+      *v->profile = Profile{};
+}
+
+static void WriteFlat(FILE *f, const Profile &prof, int cpu)
+{
+   static const std::array<OpName, 256> nmos = OpNameInit<NMOS6502>();
+   static const std::array<OpName, 256> cmos = OpNameInit<WDC65C02>();
+   auto const &names = cpu == V6502_65C02 ? cmos : nmos;
+   uint64_t count = 0, ticks = 0;
+   for (int op = 0; op < 256; op++) {
+      count += prof.op_count[op];
+      ticks += prof.op_ticks[op];
+   }
+   auto const pct = [&](uint64_t t) { return ticks ? 100.0 * t / ticks : 0.0; };
+   fprintf(f, "# %llu instructions, %llu ticks\n",
+           (unsigned long long)count, (unsigned long long)ticks);
+
+   // entries by decreasing ticks
+   auto const sorted = [](const uint64_t *t, int n) {
+      std::vector<int> order;
+      for (int i = 0; i < n; i++)
+         if (t[i])
+            order.push_back(i);
+      std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return t[a] > t[b]; });
+      return order;
+   };
+
+   fprintf(f, "\n# opcode instruction %12s %14s %7s\n", "count", "ticks", "%ticks");
+   for (int op : sorted(prof.op_ticks, 256))
+      fprintf(f, "%-8.2X %-3s %-7s %12llu %14llu %7.2f\n", op,
+              names[op].mnemonic.c_str(), names[op].mode.c_str(),
+              (unsigned long long)prof.op_count[op], (unsigned long long)prof.op_ticks[op],
+              pct(prof.op_ticks[op]));
+
+   std::vector<std::string> modes;
+   std::vector<uint64_t> mode_count, mode_ticks;
+   for (int op = 0; op < 256; op++) {
+      if (!prof.op_count[op])
+         continue;
+      auto const it = std::find(modes.begin(), modes.end(), names[op].mode);
+      size_t const i = it - modes.begin();
+      if (it == modes.end()) {
+         modes.push_back(names[op].mode);
+         mode_count.push_back(0);
+         mode_ticks.push_back(0);
+      }
+      mode_count[i] += prof.op_count[op];
+      mode_ticks[i] += prof.op_ticks[op];
+   }
+   fprintf(f, "\n# mode %12s %14s %7s\n", "count", "ticks", "%ticks");
+   for (int i : sorted(mode_ticks.data(), modes.size()))
+      fprintf(f, "%-6s %12llu %14llu %7.2f\n", modes[i].c_str(),
+              (unsigned long long)mode_count[i], (unsigned long long)mode_ticks[i],
+              pct(mode_ticks[i]));
+
+   fprintf(f, "\n# address %12s %14s %7s\n", "count", "ticks", "%ticks");
+   for (int pc : sorted(prof.pc_ticks.data(), 65536))
+      fprintf(f, "$%04X    %12llu %14llu %7.2f\n", pc,
+              (unsigned long long)prof.pc_count[pc], (unsigned long long)prof.pc_ticks[pc],
+              pct(prof.pc_ticks[pc]));
+
+   fprintf(f, "\n# device %12s %12s\n", "reads", "writes");
+   for (int addr = 0; addr < 65536; addr++)
+      if (prof.io_reads[addr] || prof.io_writes[addr])
+         fprintf(f, "$%04X   %12llu %12llu\n", addr,
+                 (unsigned long long)prof.io_reads[addr], (unsigned long long)prof.io_writes[addr]);
+}
+
+// one line per call path: frames separated by semicolons, then the ticks
+static void WriteCollapsed(FILE *f, const Profile &prof)
+{
+   std::vector<std::string> paths(prof.nodes.size());
+   for (size_t i = 0; i < prof.nodes.size(); i++) {
+      auto const &n = prof.nodes[i];
+      char name[8];
+      snprintf(name, sizeof name, "$%04X", n.addr);
+      // parents are always created before their children
+      paths[i] = n.parent < 0 ? "6502" : paths[n.parent] + ";" + name;
+      if (n.ticks)
+         fprintf(f, "%s %llu\n", paths[i].c_str(), (unsigned long long)n.ticks);
+   }
+}
+
+bool WriteProfile6502(Virtual_6502 *v6502, const char *path, int format)
+{
+   auto *const v = static_cast<V6502*>(v6502);
+   FILE *const f = fopen(path, "w");
+   if (!f)
+      return false;
+   Profile const empty;
+   auto const &prof = v->profile ? *v->profile : empty;
+   if (format == V6502_PROFILE_COLLAPSED)
+      WriteCollapsed(f, prof);
+   else
+      WriteFlat(f, prof, v->cpu);
+   return !ferror(f) & !fclose(f);
 }
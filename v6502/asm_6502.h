@@ -3,7 +3,7 @@
 
 typedef struct VIRTUAL_6502
 {
-   // address of virtual address space (64Kb aligned on a 64Kb boundary)
+   // address of virtual address space, NULL for forks
    unsigned char *address_space;
    // special range begin (absolute address)
    unsigned char *special_start;
@@ -38,10 +38,267 @@ typedef struct VIRTUAL_6502
    int S;
    // initial value for P  (0x00->0xFF)
    int P;
+   // interpreter engine, set by New6502
+   int engine;
+   // CPU variant, set by New6502
+   int cpu;
+   // why the last Execute6502 returned
+   int stop;
+   // clock ticks executed so far
+   long long cycle;
+   // tick of the access within the instruction, from 0 (valid during a
+   // callback with the V6502_EXACT engine)
+   int special_tick;
 } Virtual_6502;
 
-Virtual_6502 *New6502(void);
+// interpreter engines
+enum {
+   // handlers called through a table of member function pointers
+   V6502_TABLE,
+   // all handlers inlined in a single switch statement
+   V6502_SWITCH,
+   // basic blocks decoded once and kept in a translation cache; blocks are
+   // invalidated by the 6502 writing to their pages, Flush6502 must be
+   // called after changing code in address_space from outside
+   V6502_CACHED,
+   // the switch engine also charging the extra ticks of taken branches
+   // crossing a page, BBR/BBS included, of indexed reads crossing a page
+   // and of the 65C02 shifts abs,X crossing a page, and timing device
+   // accesses to the tick, see special_tick and Cycle6502
+   V6502_EXACT
+};
+
+// CPU variants
+enum {
+   // NMOS 6502, with the stable undocumented opcodes
+   V6502_NMOS,
+   // WDC 65C02: BRA, STZ, TSB/TRB, PHX/PHY/PLX/PLY, (zp), JMP (abs,X), the
+   // bit instructions and WAI; JMP (abs) without the page wrap, decimal
+   // ADC/SBC set N and Z and take a tick more, interrupts clear D. STP
+   // stops as illegal, the other undefined opcodes are NOPs
+   V6502_65C02
+};
+
+// stop reasons
+enum {
+   // the tick budget ran out
+   V6502_BUDGET,
+   // an illegal opcode (a JAM or an unstable undocumented one, STP on the
+   // 65C02) was fetched, PC points past it
+   V6502_ILLEGAL,
+   // Stop6502 was called
+   V6502_STOPPED
+};
+
+Virtual_6502 *New6502(int engine = V6502_TABLE, int cpu = V6502_NMOS);
 void Free6502(Virtual_6502 *v6502);
+// executes at least nticks clock ticks (the last instruction may overshoot)
+// and returns the number of ticks actually executed, see stop for the reason
 int Execute6502(Virtual_6502 *v6502,int nticks);
+// makes Execute6502 return once the current instruction is complete; only
+// meaningful from a callback
+void Stop6502(Virtual_6502 *v6502);
+// drops all translated code
+void Flush6502(Virtual_6502 *v6502);
+// clock ticks executed so far, counting the running Execute6502; during a
+// device callback the tick of the access with V6502_EXACT, the tick at the
+// end of the running block with V6502_CACHED, which charges a translated
+// block at once, and the tick at the end of the instruction otherwise
+long long Cycle6502(Virtual_6502 *v6502);
+
+// Events: fn runs within Execute6502 at the first instruction boundary at
+// or after cycle, with the registers stored in the Virtual_6502 fields and
+// reloaded afterwards. Execution is sliced at the next event, so timed
+// devices need not return to the host. Events due when Execute6502 starts
+// run before the first instruction. Events are not part of snapshots and
+// state files.
+
+typedef void (*Event6502)(Virtual_6502 *v6502, long long cycle, void *user);
+
+// returns an id for Cancel6502; fn may schedule further events, change
+// the registers or call Stop6502
+int Schedule6502(Virtual_6502 *v6502, long long cycle, Event6502 fn, void *user);
+// false if the event already ran or was cancelled
+bool Cancel6502(Virtual_6502 *v6502, int id);
+
+// Interrupt lines, sampled at instruction boundaries within Execute6502 and
+// at its start; the cached engine samples them at the end of the running
+// block. Taking an interrupt costs 7 ticks and pushes PC and P with B
+// clear. The lines are not part of snapshots and state files.
+
+// holds or releases IRQ for the sources in the mask; IRQ is taken while
+// any source holds it and I is clear
+void IRQ6502(Virtual_6502 *v6502, unsigned sources, bool asserted);
+// NMI is edge triggered: taken once per call
+void NMI6502(Virtual_6502 *v6502);
+// RESET: S drops by 3 without writing, I is set and PC loads from $FFFC
+void Reset6502(Virtual_6502 *v6502);
+
+// Idle skipping: a loop polling a device is skipped to the end of the
+// slice, that is to the next event or the end of the budget, once one
+// iteration went by reading the same value with the same registers,
+// without changing memory or accessing other devices. The read handler is
+// not called for the iterations skipped: it must have no side effects and
+// keep returning the same value until the host or an event changes it.
+// Off by default, and not applied while rewinding or profiling. A 65C02
+// in WAI always skips to the end of the slice.
+void SkipIdle6502(Virtual_6502 *v6502, bool enable);
+
+// Dirty pages: sets bit (page & 7) of dirty[page >> 3] for every page
+// whose content may have changed since the previous call, and starts over;
+// the first call reports every page. Writes by the 6502, Poke6502,
+// Restore6502, rewinding and remapping are tracked; the first write to a
+// page after a call takes the slow path, later ones cost nothing. Host
+// writes straight to address_space or to Map6502 memory are not tracked.
+void DirtyPages6502(Virtual_6502 *v6502, unsigned char dirty[32]);
+
+// Memory map, in 256 byte pages. New6502 maps every page to address_space;
+// special_start, special_end and rom_start are applied on top of that at the
+// start of Execute6502 whenever they have changed, except for the pages
+// mapped with Map6502 or MapIO6502.
+
+// device handlers, addr is the 6502 address (0x0000->0xFFFF)
+typedef int (*IORead6502)(Virtual_6502 *v6502, int addr, void *user);
+typedef void (*IOWrite6502)(Virtual_6502 *v6502, int addr, int value, void *user);
+
+// maps count pages starting with page first to host memory, read and write
+// point to the storage of the first page; a NULL read makes the pages read
+// as 0xFF, a NULL write makes them read-only
+void Map6502(Virtual_6502 *v6502, int first, int count,
+             unsigned char *read, unsigned char *write);
+// maps count pages starting with page first to device handlers; a NULL
+// handler makes the pages read as 0xFF or ignore writes
+void MapIO6502(Virtual_6502 *v6502, int first, int count,
+               IORead6502 read, IOWrite6502 write, void *user);
+
+// Snapshots hold the registers, the memory map and the content of every
+// page that is not host memory mapped with Map6502. Pages are shared
+// copy-on-write between snapshots and forks, so each of them costs memory
+// for the pages written since it was taken. address_space is the live
+// memory of an instance and can't be shared: the first snapshot copies all
+// of it, and every Save6502 compares all of it with the previous copy, so
+// that writes by the host are seen too. Call these between Execute6502
+// calls only.
+
+struct Snapshot6502;
+
+Snapshot6502 *Save6502(Virtual_6502 *v6502);
+// returns the registers and the memory map to a snapshot, which may have
+// been taken from another instance
+void Restore6502(Virtual_6502 *v6502, const Snapshot6502 *snapshot);
+void FreeSnapshot6502(Snapshot6502 *snapshot);
+// new instances sharing the memory of a snapshot or of another instance,
+// with the same CPU variant; forks have no address_space and the special
+// range is not applied to them, their pages are only reachable through
+// the memory map
+Virtual_6502 *Fork6502(const Snapshot6502 *snapshot, int engine = V6502_TABLE);
+Virtual_6502 *Fork6502(Virtual_6502 *v6502);
+// reads and writes memory through the map, bypassing device handlers; Peek6502
+// returns 0xFF for pages without storage, Poke6502 ignores read-only pages
+int Peek6502(Virtual_6502 *v6502, int addr);
+void Poke6502(Virtual_6502 *v6502, int addr, int value);
+
+// State files hold the registers, the CPU variant, the special range and
+// the 64K of memory, see asm_6502.cpp for the layout. Device and host
+// memory mappings are not saved; forks are saved as they read through the
+// memory map.
+
+enum {
+   // store only the pages that are not blank, compressed, instead of the
+   // whole image
+   V6502_STATE_SPARSE = 0x01
+};
+
+// writes a state file; when the file already holds a memory image only the
+// changed pages are rewritten, otherwise a new file replaces it, so that
+// instances loaded from the old file keep their memory
+bool SaveFile6502(Virtual_6502 *v6502, const char *path, int flags = 0);
+// creates an instance from a state file or an old apple2.img dump, the
+// memory image is mapped from the file when possible; NULL on error
+Virtual_6502 *LoadFile6502(const char *path, int engine = V6502_TABLE);
+
+// Shared address space: address_space in shared memory that monitor,
+// renderer or debugger processes map read-only, without copies. The 64K
+// are followed by a Shared6502 page. Pages remapped with Map6502 or
+// MapIO6502 are not seen through it. Unix only, NULL elsewhere.
+
+struct Shared6502 {
+   // odd while Execute6502, Poke6502, Restore6502, Map6502, MapIO6502,
+   // StepBack6502 or RunBack6502 runs, even between calls. Writes by the
+   // host straight to address_space are not covered.
+   unsigned sequence;
+   // the registers and cycle as the last of those calls left them
+   int PC, A, X, Y, S, P;
+   long long cycle;
+};
+
+Virtual_6502 *NewShared6502(int engine = V6502_TABLE, int cpu = V6502_NMOS);
+// the shared memory, to hand to other processes (inherited, SCM_RIGHTS or
+// /proc/<pid>/fd); -1 when the instance is not shared
+int SharedFd6502(Virtual_6502 *v6502);
+
+// the reader side: maps the 64K and the Shared6502 of the fd read-only,
+// NULL on error
+const unsigned char *MapShared6502(int fd);
+void UnmapShared6502(const unsigned char *mem);
+// what was read between Sequence6502 and Unchanged6502 returning true for
+// that sequence is a consistent frame: memory and registers between two
+// of the calls above
+unsigned Sequence6502(const unsigned char *mem);
+bool Unchanged6502(const unsigned char *mem, unsigned sequence);
+
+// Rewind: while enabled, Execute6502 runs the switch engine and journals
+// the registers before every instruction and the old value of every byte
+// of memory the 6502 writes, into a ring buffer of bounded size. Device
+// side effects and host changes to memory are not undone.
+
+// enables rewinding with a journal of about size bytes, 0 disables it
+void Rewind6502(Virtual_6502 *v6502, int size);
+// returns to the start of the last instruction executed; false when the
+// journal is empty
+bool StepBack6502(Virtual_6502 *v6502);
+// returns to the last instruction boundary at or before cycle; false when
+// the journal doesn't reach back that far
+bool RunBack6502(Virtual_6502 *v6502, long long cycle);
+
+// Profiler: while profiling, Execute6502 runs the table engine counting the
+// executions and ticks of every opcode and address, the device accesses
+// of every address, and the ticks of every call path followed through
+// JSR/BRK and RTS/RTI. Rewinding takes precedence over profiling.
+
+// profile formats
+enum {
+   // tables by opcode, addressing mode, address and device address
+   V6502_PROFILE_FLAT,
+   // "6502;$caller;$callee ticks" lines, as read by flamegraph tools
+   V6502_PROFILE_COLLAPSED
+};
+
+// starts or stops profiling; counters are kept until ClearProfile6502
+void Profile6502(Virtual_6502 *v6502, bool enable);
+void ClearProfile6502(Virtual_6502 *v6502);
+bool WriteProfile6502(Virtual_6502 *v6502, const char *path, int format);
+
+// Batch execution: many independent instances run on a pool of threads.
+// Instances must not share memory that is written, callbacks run on the
+// pool threads.
+
+struct Batch6502 {
+   // instance to run and its tick budget
+   Virtual_6502 *v6502;
+   int ticks;
+   // ticks executed and stop reason, set by ExecuteBatch6502
+   int executed;
+   int stop;
+};
+
+struct Pool6502;
+
+// creates a pool of threads, 0 for one per hardware thread
+Pool6502 *NewPool6502(int threads = 0);
+void FreePool6502(Pool6502 *pool);
+// runs every job of the batch and returns when all of them are done; the
+// calling thread takes part in the work
+void ExecuteBatch6502(Pool6502 *pool, Batch6502 *jobs, int count);
 
 #endif
@@ -0,0 +1,164 @@
+// 6502 opcode table: opcode, clock ticks, operation, addressing mode.
+// The ticks leave out the extra ticks of taken branches and of indexed
+// reads crossing a page.
+// Included by asm_6502.cpp with defop() defined to build each interpreter,
+// and Cpu naming the CPU variant. These are the opcodes every variant
+// shares; asm_6502_ops_nmos.h and asm_6502_ops_65c02.h hold the rest.
+
+defop(00,7,brk<Cpu>,nop);
+defop(10,2,bpl,rel);
+defop(20,6,jsr,abs);
+defop(30,2,bmi,rel);
+defop(40,6,rti,nop);
+defop(50,2,bvc,rel);
+defop(60,6,rts,nop);
+defop(70,2,bvs,rel);
+defop(90,2,bcc,rel);
+defop(A0,2,ldyimm,nop);
+defop(B0,2,bcs,rel);
+defop(C0,2,cpyimm,nop);
+defop(D0,2,bne,rel);
+defop(E0,2,cpximm,nop);
+defop(F0,2,beq,rel);
+
+defop(01,6,ora,zpxi);
+defop(11,5,ora,zpiy);
+defop(21,6,and,zpxi);
+defop(31,5,and,zpiy);
+defop(41,6,eor,zpxi);
+defop(51,5,eor,zpiy);
+defop(61,6,adc<Cpu>,zpxi);
+defop(71,5,adc<Cpu>,zpiy);
+defop(81,6,sta,zpxi);
+defop(91,6,sta,zpiy);
+defop(A1,6,lda,zpxi);
+defop(B1,5,lda,zpiy);
+defop(C1,6,cmp,zpxi);
+defop(D1,5,cmp,zpiy);
+defop(E1,6,sbc<Cpu>,zpxi);
+defop(F1,5,sbc<Cpu>,zpiy);
+
+defop(A2,2,ldximm,nop);
+
+defop(24,3,bit,zp);
+defop(84,3,sty,zp);
+defop(94,4,sty,zpx);
+defop(A4,3,ldy,zp);
+defop(B4,4,ldy,zpx);
+defop(C4,3,cpy,zp);
+defop(E4,3,cpx,zp);
+
+defop(05,3,ora,zp);
+defop(15,4,ora,zpx);
+defop(25,3,and,zp);
+defop(35,4,and,zpx);
+defop(45,3,eor,zp);
+defop(55,4,eor,zpx);
+defop(65,3,adc<Cpu>,zp);
+defop(75,4,adc<Cpu>,zpx);
+defop(85,3,sta,zp);
+defop(95,4,sta,zpx);
+defop(A5,3,lda,zp);
+defop(B5,4,lda,zpx);
+defop(C5,3,cmp,zp);
+defop(D5,4,cmp,zpx);
+defop(E5,3,sbc<Cpu>,zp);
+defop(F5,4,sbc<Cpu>,zpx);
+
+defop(06,5,asl,zp);
+defop(16,6,asl,zpx);
+defop(26,5,rol,zp);
+defop(36,6,rol,zpx);
+defop(46,5,lsr,zp);
+defop(56,6,lsr,zpx);
+defop(66,5,ror,zp);
+defop(76,6,ror,zpx);
+defop(86,3,stx,zp);
+defop(96,4,stx,zpy);
+defop(A6,3,ldx,zp);
+defop(B6,4,ldx,zpy);
+defop(C6,5,dec,zp);
+defop(D6,6,dec,zpx);
+defop(E6,5,inc,zp);
+defop(F6,6,inc,zpx);
+
+defop(08,3,php,nop);
+defop(18,2,clc,nop);
+defop(28,4,plp,nop);
+defop(38,2,sec,nop);
+defop(48,3,pha,nop);
+defop(58,2,cli,nop);
+defop(68,4,pla,nop);
+defop(78,2,sei,nop);
+defop(88,2,dey,nop);
+defop(98,2,tya,nop);
+defop(A8,2,tay,nop);
+defop(B8,2,clv,nop);
+defop(C8,2,iny,nop);
+defop(D8,2,cld,nop);
+defop(E8,2,inx,nop);
+defop(F8,2,sed,nop);
+
+defop(09,2,oraimm,nop);
+defop(19,4,ora,absy);
+defop(29,2,andimm,nop);
+defop(39,4,and,absy);
+defop(49,2,eorimm,nop);
+defop(59,4,eor,absy);
+defop(69,2,adcimm<Cpu>,nop);
+defop(79,4,adc<Cpu>,absy);
+defop(99,5,sta,absy);
+defop(A9,2,ldaimm,nop);
+defop(B9,4,lda,absy);
+defop(C9,2,cmpimm,nop);
+defop(D9,4,cmp,absy);
+defop(E9,2,sbcimm<Cpu>,nop);
+defop(F9,4,sbc<Cpu>,absy);
+
+defop(0A,2,asla,nop);
+defop(2A,2,rola,nop);
+defop(4A,2,lsra,nop);
+defop(6A,2,rora,nop);
+defop(8A,2,txa,nop);
+defop(9A,2,txs,nop);
+defop(AA,2,tax,nop);
+defop(BA,2,tsx,nop);
+defop(CA,2,dex,nop);
+defop(EA,2,nop,nop);
+
+defop(2C,4,bit,abs);
+defop(4C,3,jmp,abs);
+defop(8C,4,sty,abs);
+defop(AC,4,ldy,abs);
+defop(BC,4,ldy,absx);
+defop(CC,4,cpy,abs);
+defop(EC,4,cpx,abs);
+
+defop(0D,4,ora,abs);
+defop(1D,4,ora,absx);
+defop(2D,4,and,abs);
+defop(3D,4,and,absx);
+defop(4D,4,eor,abs);
+defop(5D,4,eor,absx);
+defop(6D,4,adc<Cpu>,abs);
+defop(7D,4,adc<Cpu>,absx);
+defop(8D,4,sta,abs);
+defop(9D,5,sta,absx);
+defop(AD,4,lda,abs);
+defop(BD,4,lda,absx);
+defop(CD,4,cmp,abs);
+defop(DD,4,cmp,absx);
+defop(ED,4,sbc<Cpu>,abs);
+defop(FD,4,sbc<Cpu>,absx);
+
+defop(0E,6,asl,abs);
+defop(2E,6,rol,abs);
+defop(4E,6,lsr,abs);
+defop(6E,6,ror,abs);
+defop(8E,4,stx,abs);
+defop(AE,4,ldx,abs);
+defop(BE,4,ldx,absy);
+defop(CE,6,dec,abs);
+defop(DE,7,dec,absx);
+defop(EE,6,inc,abs);
+defop(FE,7,inc,absx);
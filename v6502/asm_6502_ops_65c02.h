@@ -0,0 +1,119 @@
+// 65C02 opcodes, with asm_6502_ops.h. STP stays illegal, so that
+// Execute6502 returns at it; the other opcodes the 65C02 leaves undefined
+// are NOPs of various sizes.
+
+defop(6C,6,jmp,ind);
+defop(7C,6,jmp,absxi);
+defop(1E,6,asl,absx);
+defop(3E,6,rol,absx);
+defop(5E,6,lsr,absx);
+defop(7E,6,ror,absx);
+
+defop(80,2,bra,rel);
+defop(1A,2,inca,nop);
+defop(3A,2,deca,nop);
+defop(5A,3,phy,nop);
+defop(7A,4,ply,nop);
+defop(DA,3,phx,nop);
+defop(FA,4,plx,nop);
+defop(CB,3,wai,nop);
+
+defop(12,5,ora,zpi);
+defop(32,5,and,zpi);
+defop(52,5,eor,zpi);
+defop(72,5,adc<Cpu>,zpi);
+defop(92,5,sta,zpi);
+defop(B2,5,lda,zpi);
+defop(D2,5,cmp,zpi);
+defop(F2,5,sbc<Cpu>,zpi);
+
+defop(89,2,bitimm,nop);
+defop(34,4,bit,zpx);
+defop(3C,4,bit,absx);
+defop(64,3,stz,zp);
+defop(74,4,stz,zpx);
+defop(9C,4,stz,abs);
+defop(9E,5,stz,absx);
+defop(04,5,tsb,zp);
+defop(0C,6,tsb,abs);
+defop(14,5,trb,zp);
+defop(1C,6,trb,abs);
+
+defop(07,5,rmb0,zp);
+defop(17,5,rmb1,zp);
+defop(27,5,rmb2,zp);
+defop(37,5,rmb3,zp);
+defop(47,5,rmb4,zp);
+defop(57,5,rmb5,zp);
+defop(67,5,rmb6,zp);
+defop(77,5,rmb7,zp);
+defop(87,5,smb0,zp);
+defop(97,5,smb1,zp);
+defop(A7,5,smb2,zp);
+defop(B7,5,smb3,zp);
+defop(C7,5,smb4,zp);
+defop(D7,5,smb5,zp);
+defop(E7,5,smb6,zp);
+defop(F7,5,smb7,zp);
+
+defop(0F,5,bbr0,zprel);
+defop(1F,5,bbr1,zprel);
+defop(2F,5,bbr2,zprel);
+defop(3F,5,bbr3,zprel);
+defop(4F,5,bbr4,zprel);
+defop(5F,5,bbr5,zprel);
+defop(6F,5,bbr6,zprel);
+defop(7F,5,bbr7,zprel);
+defop(8F,5,bbs0,zprel);
+defop(9F,5,bbs1,zprel);
+defop(AF,5,bbs2,zprel);
+defop(BF,5,bbs3,zprel);
+defop(CF,5,bbs4,zprel);
+defop(DF,5,bbs5,zprel);
+defop(EF,5,bbs6,zprel);
+defop(FF,5,bbs7,zprel);
+
+defop(02,2,nopimm,nop);
+defop(22,2,nopimm,nop);
+defop(42,2,nopimm,nop);
+defop(62,2,nopimm,nop);
+defop(82,2,nopimm,nop);
+defop(C2,2,nopimm,nop);
+defop(E2,2,nopimm,nop);
+defop(03,1,nop,nop);
+defop(13,1,nop,nop);
+defop(23,1,nop,nop);
+defop(33,1,nop,nop);
+defop(43,1,nop,nop);
+defop(53,1,nop,nop);
+defop(63,1,nop,nop);
+defop(73,1,nop,nop);
+defop(83,1,nop,nop);
+defop(93,1,nop,nop);
+defop(A3,1,nop,nop);
+defop(B3,1,nop,nop);
+defop(C3,1,nop,nop);
+defop(D3,1,nop,nop);
+defop(E3,1,nop,nop);
+defop(F3,1,nop,nop);
+defop(0B,1,nop,nop);
+defop(1B,1,nop,nop);
+defop(2B,1,nop,nop);
+defop(3B,1,nop,nop);
+defop(4B,1,nop,nop);
+defop(5B,1,nop,nop);
+defop(6B,1,nop,nop);
+defop(7B,1,nop,nop);
+defop(8B,1,nop,nop);
+defop(9B,1,nop,nop);
+defop(AB,1,nop,nop);
+defop(BB,1,nop,nop);
+defop(EB,1,nop,nop);
+defop(FB,1,nop,nop);
+defop(44,3,nop,zp);
+defop(54,4,nop,zpx);
+defop(D4,4,nop,zpx);
+defop(F4,4,nop,zpx);
+defop(5C,8,nop,abs);
+defop(DC,4,nop,abs);
+defop(FC,4,nop,abs);
@@ -0,0 +1,105 @@
+// NMOS 6502 opcodes, with asm_6502_ops.h.
+
+defop(6C,5,jmp,absi);
+defop(1E,7,asl,absx);
+defop(3E,7,rol,absx);
+defop(5E,7,lsr,absx);
+defop(7E,7,ror,absx);
+
+// Undocumented NMOS opcodes. The unstable ones (ANE, LXA, SHA, SHX, SHY,
+// TAS, LAS) and the JAMs stay illegal.
+
+defop(1A,2,nop,nop);
+defop(3A,2,nop,nop);
+defop(5A,2,nop,nop);
+defop(7A,2,nop,nop);
+defop(DA,2,nop,nop);
+defop(FA,2,nop,nop);
+defop(80,2,nopimm,nop);
+defop(82,2,nopimm,nop);
+defop(89,2,nopimm,nop);
+defop(C2,2,nopimm,nop);
+defop(E2,2,nopimm,nop);
+defop(04,3,nop,zp);
+defop(44,3,nop,zp);
+defop(64,3,nop,zp);
+defop(14,4,nop,zpx);
+defop(34,4,nop,zpx);
+defop(54,4,nop,zpx);
+defop(74,4,nop,zpx);
+defop(D4,4,nop,zpx);
+defop(F4,4,nop,zpx);
+defop(0C,4,nop,abs);
+defop(1C,4,nop,absx);
+defop(3C,4,nop,absx);
+defop(5C,4,nop,absx);
+defop(7C,4,nop,absx);
+defop(DC,4,nop,absx);
+defop(FC,4,nop,absx);
+
+defop(0B,2,ancimm,nop);
+defop(2B,2,ancimm,nop);
+defop(4B,2,alrimm,nop);
+defop(6B,2,arrimm,nop);
+defop(CB,2,sbximm,nop);
+defop(EB,2,sbcimm<Cpu>,nop);
+
+defop(A7,3,lax,zp);
+defop(B7,4,lax,zpy);
+defop(AF,4,lax,abs);
+defop(BF,4,lax,absy);
+defop(A3,6,lax,zpxi);
+defop(B3,5,lax,zpiy);
+
+defop(87,3,sax,zp);
+defop(97,4,sax,zpy);
+defop(8F,4,sax,abs);
+defop(83,6,sax,zpxi);
+
+defop(07,5,slo,zp);
+defop(17,6,slo,zpx);
+defop(0F,6,slo,abs);
+defop(1F,7,slo,absx);
+defop(1B,7,slo,absy);
+defop(03,8,slo,zpxi);
+defop(13,8,slo,zpiy);
+
+defop(27,5,rla,zp);
+defop(37,6,rla,zpx);
+defop(2F,6,rla,abs);
+defop(3F,7,rla,absx);
+defop(3B,7,rla,absy);
+defop(23,8,rla,zpxi);
+defop(33,8,rla,zpiy);
+
+defop(47,5,sre,zp);
+defop(57,6,sre,zpx);
+defop(4F,6,sre,abs);
+defop(5F,7,sre,absx);
+defop(5B,7,sre,absy);
+defop(43,8,sre,zpxi);
+defop(53,8,sre,zpiy);
+
+defop(67,5,rra,zp);
+defop(77,6,rra,zpx);
+defop(6F,6,rra,abs);
+defop(7F,7,rra,absx);
+defop(7B,7,rra,absy);
+defop(63,8,rra,zpxi);
+defop(73,8,rra,zpiy);
+
+defop(C7,5,dcp,zp);
+defop(D7,6,dcp,zpx);
+defop(CF,6,dcp,abs);
+defop(DF,7,dcp,absx);
+defop(DB,7,dcp,absy);
+defop(C3,8,dcp,zpxi);
+defop(D3,8,dcp,zpiy);
+
+defop(E7,5,isc,zp);
+defop(F7,6,isc,zpx);
+defop(EF,6,isc,abs);
+defop(FF,7,isc,absx);
+defop(FB,7,isc,absy);
+defop(E3,8,isc,zpxi);
+defop(F3,8,isc,zpiy);
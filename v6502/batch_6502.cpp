@@ -0,0 +1,154 @@
+// Batch execution of independent virtual 6502 instances on a thread pool.
+//
+// Each worker owns a range of job indices and takes jobs from its front;
+// a worker whose range is empty steals the upper half of another worker's
+// range. A range is a single 64-bit word (end << 32 | begin) changed with
+// compare-and-swap only, jobs are never added during a batch so a worker
+// is done once every range is empty.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "asm_6502.h"
+
+struct Pool6502 {
+   struct Range {
+      std::atomic<uint64_t> jobs;
+      char pad[64 - sizeof(std::atomic<uint64_t>)];   // one cache line each
+   };
+
+   std::vector<std::thread> threads;
+   std::unique_ptr<Range[]> ranges;   // one per thread, the caller last
+   int workers;
+
+   std::mutex lock;
+   std::condition_variable wake, done;
+   Batch6502 *jobs;
+   unsigned batch;                    // incremented for every batch
+   int busy;                          // workers not done with the batch
+   bool quit;
+
+   static uint64_t pack(uint32_t begin, uint32_t end) {
+      return (uint64_t)end << 32 | begin;
+   }
+
+   int take(int w);
+   int steal(int w);
+   void work(int w);
+   void thread(int w);
+};
+
+int Pool6502::take(int w)
+{
+   auto &r = ranges[w].jobs;
+   uint64_t cur = r.load(std::memory_order_relaxed);
+   for (;;) {
+      uint32_t const begin = cur, end = cur >> 32;
+      if (begin >= end)
+         return -1;
+      if (r.compare_exchange_weak(cur, pack(begin + 1, end), std::memory_order_acq_rel))
+         return begin;
+   }
+}
+
+// returns -1 when all ranges were seen empty
+int Pool6502::steal(int w)
+{
+   for (;;) {
+      bool seen = false;
+      for (int i = 1; i < workers; i++) {
+         auto &r = ranges[(w + i) % workers].jobs;
+         uint64_t cur = r.load(std::memory_order_relaxed);
+         uint32_t const begin = cur, end = cur >> 32;
+         if (begin >= end)
+            continue;
+         seen = true;
+         uint32_t const mid = begin + (end - begin) / 2;
+         if (!r.compare_exchange_strong(cur, pack(begin, mid), std::memory_order_acq_rel))
+            continue;
+         ranges[w].jobs.store(pack(mid + 1, end), std::memory_order_release);
+         return mid;
+      }
+      if (!seen)
+         return -1;
+   }
+}
+
+void Pool6502::work(int w)
+{
+   for (;;) {
+      int job = take(w);
+      if (job < 0)
+         job = steal(w);
+      if (job < 0)
+         break;
+      auto &j = jobs[job];
+      j.executed = Execute6502(j.v6502, j.ticks);
+      j.stop = j.v6502->stop;
+   }
+   std::lock_guard<std::mutex> l(lock);
+   if (!--busy)
+      done.notify_all();
+}
+
+void Pool6502::thread(int w)
+{
+   unsigned seen = 0;
+   for (;;) {
+      {
+         std::unique_lock<std::mutex> l(lock);
+         wake.wait(l, [&]{ return quit || batch != seen; });
+         if (quit)
+            return;
+         seen = batch;
+      }
+      work(w);
+   }
+}
+
+Pool6502 *NewPool6502(int threads)
+{
+   if (threads <= 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+   auto *const pool = new Pool6502{};
+   pool->workers = threads;
+   pool->ranges.reset(new Pool6502::Range[threads]);
+   for (int w = 0; w < threads - 1; w++)
+      pool->threads.emplace_back(&Pool6502::thread, pool, w);
+   return pool;
+}
+
+void FreePool6502(Pool6502 *pool)
+{
+   {
+      std::lock_guard<std::mutex> l(pool->lock);
+      pool->quit = true;
+   }
+   pool->wake.notify_all();
+   for (auto &t : pool->threads)
+      t.join();
+   delete pool;
+}
+
+void ExecuteBatch6502(Pool6502 *pool, Batch6502 *jobs, int count)
+{
+   int const n = pool->workers;
+   for (int w = 0; w < n; w++)
+      pool->ranges[w].jobs.store(Pool6502::pack((int64_t)count * w / n, (int64_t)count * (w + 1) / n),
+                                 std::memory_order_relaxed);
+   {
+      std::lock_guard<std::mutex> l(pool->lock);
+      pool->jobs = jobs;
+      pool->busy = n;
+      pool->batch++;
+   }
+   pool->wake.notify_all();
+   pool->work(n - 1);
+   std::unique_lock<std::mutex> l(pool->lock);
+   pool->done.wait(l, [&]{ return !pool->busy; });
+}
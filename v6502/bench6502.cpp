@@ -0,0 +1,319 @@
+// Throughput benchmark for the virtual 6502 core.
+//
+// Every workload is a small endless 6502 program loaded at $1000; it is run
+// for a fixed budget of clock ticks, once stepping one instruction at a time
+// to count the dispatched instructions, then several times at full speed with
+// every interpreter engine, and with the switch engine recording a rewind
+// journal; no workload crosses a page, so the exact engine runs the same
+// ticks. The idle workload runs with SkipIdle6502: it skips most of its
+// ticks rather than emulating them, so only its wall time per budget (ms)
+// is reported, not a clock rate. Finally the budget is split among many
+// instances run as a batch on thread pools of increasing size.
+//
+// usage: bench6502 [ticks [runs [workload...]]]
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "asm_6502.h"
+
+struct Workload {
+   const char *name;
+   std::vector<unsigned char> code;
+   bool skip_idle = false;
+};
+
+static const Workload workloads[] = {
+   {"alu", {                    // tight ALU loop on registers
+       0xA9, 0x00,              // 1000 LDA #$00
+       0x18,                    // 1002 CLC
+       0x69, 0x03,              // 1003 ADC #$03
+       0x49, 0x5A,              // 1005 EOR #$5A
+       0x29, 0x7F,              // 1007 AND #$7F
+       0x09, 0x01,              // 1009 ORA #$01
+       0x0A,                    // 100B ASL A
+       0x4A,                    // 100C LSR A
+       0x2A,                    // 100D ROL A
+       0x6A,                    // 100E ROR A
+       0xE8,                    // 100F INX
+       0xC8,                    // 1010 INY
+       0xC9, 0x40,              // 1011 CMP #$40
+       0xD0, 0xED,              // 1013 BNE $1002
+       0x4C, 0x00, 0x10,        // 1015 JMP $1000
+    }},
+   {"zeropage", {               // zero page loads, stores and read-modify-write
+       0xA2, 0x00,              // 1000 LDX #$00
+       0xB5, 0x10,              // 1002 LDA $10,X
+       0x65, 0x20,              // 1004 ADC $20
+       0x95, 0x10,              // 1006 STA $10,X
+       0xE6, 0x30,              // 1008 INC $30
+       0xA5, 0x30,              // 100A LDA $30
+       0x85, 0x20,              // 100C STA $20
+       0x46, 0x31,              // 100E LSR $31
+       0x26, 0x32,              // 1010 ROL $32
+       0xE8,                    // 1012 INX
+       0xE0, 0x40,              // 1013 CPX #$40
+       0xD0, 0xEB,              // 1015 BNE $1002
+       0x4C, 0x00, 0x10,        // 1017 JMP $1000
+    }},
+   {"indirect", {               // ($F0),Y walk over 4K of memory
+       0xA9, 0x00,              // 1000 LDA #$00
+       0x85, 0xF0,              // 1002 STA $F0
+       0xA9, 0x20,              // 1004 LDA #$20
+       0x85, 0xF1,              // 1006 STA $F1
+       0xA2, 0x10,              // 1008 LDX #$10
+       0xA0, 0x00,              // 100A LDY #$00
+       0xB1, 0xF0,              // 100C LDA ($F0),Y
+       0x71, 0xF0,              // 100E ADC ($F0),Y
+       0x91, 0xF0,              // 1010 STA ($F0),Y
+       0xC8,                    // 1012 INY
+       0xD0, 0xF7,              // 1013 BNE $100C
+       0xE6, 0xF1,              // 1015 INC $F1
+       0xCA,                    // 1017 DEX
+       0xD0, 0xF2,              // 1018 BNE $100C
+       0x4C, 0x00, 0x10,        // 101A JMP $1000
+    }},
+   {"bcd", {                    // decimal mode arithmetic
+       0xF8,                    // 1000 SED
+       0xA9, 0x00,              // 1001 LDA #$00
+       0xA2, 0x00,              // 1003 LDX #$00
+       0x18,                    // 1005 CLC
+       0x69, 0x01,              // 1006 ADC #$01
+       0x38,                    // 1008 SEC
+       0xE9, 0x00,              // 1009 SBC #$00
+       0x65, 0x40,              // 100B ADC $40
+       0xE5, 0x41,              // 100D SBC $41
+       0xCA,                    // 100F DEX
+       0xD0, 0xF3,              // 1010 BNE $1005
+       0xD8,                    // 1012 CLD
+       0x4C, 0x00, 0x10,        // 1013 JMP $1000
+    }},
+   {"arith", {                  // 16-bit additions, subtractions and compares
+       0xA2, 0x00,              // 1000 LDX #$00
+       0x18,                    // 1002 CLC
+       0xA5, 0x10,              // 1003 LDA $10
+       0x69, 0x37,              // 1005 ADC #$37
+       0x85, 0x10,              // 1007 STA $10
+       0xA5, 0x11,              // 1009 LDA $11
+       0x69, 0x13,              // 100B ADC #$13
+       0x85, 0x11,              // 100D STA $11
+       0x38,                    // 100F SEC
+       0xA5, 0x10,              // 1010 LDA $10
+       0xE5, 0x11,              // 1012 SBC $11
+       0xC9, 0x80,              // 1014 CMP #$80
+       0x2A,                    // 1016 ROL A
+       0x6A,                    // 1017 ROR A
+       0x65, 0x10,              // 1018 ADC $10
+       0xE9, 0x21,              // 101A SBC #$21
+       0xCA,                    // 101C DEX
+       0xD0, 0xE3,              // 101D BNE $1002
+       0x4C, 0x00, 0x10,        // 101F JMP $1000
+    }},
+   {"call", {                   // JSR/RTS and stack heavy code
+       0x20, 0x10, 0x10,        // 1000 JSR $1010
+       0x20, 0x10, 0x10,        // 1003 JSR $1010
+       0x20, 0x15, 0x10,        // 1006 JSR $1015
+       0x4C, 0x00, 0x10,        // 1009 JMP $1000
+       0xEA, 0xEA, 0xEA, 0xEA,  // 100C NOP
+       0xE8,                    // 1010 INX
+       0x20, 0x15, 0x10,        // 1011 JSR $1015
+       0x60,                    // 1014 RTS
+       0xC8,                    // 1015 INY
+       0x48,                    // 1016 PHA
+       0x68,                    // 1017 PLA
+       0x60,                    // 1018 RTS
+    }},
+   {"io", {                     // keyboard polling through the special range
+       0xAD, 0x00, 0xC0,        // 1000 LDA $C000
+       0x10, 0xFB,              // 1003 BPL $1000
+       0x8D, 0x10, 0xC0,        // 1005 STA $C010
+       0x4C, 0x00, 0x10,        // 1008 JMP $1000
+    }},
+   {"idle", {                   // polling a device that never changes
+       0xAD, 0x01, 0xC0,        // 1000 LDA $C001
+       0x10, 0xFB,              // 1003 BPL $1000
+       0x4C, 0x00, 0x10,        // 1005 JMP $1000
+    }, true},
+};
+
+static const struct {
+   const char *name;
+   int engine;
+   int rewind;          // journal size, 0 for none
+} engines[] = {
+   {"table", V6502_TABLE, 0},
+   {"switch", V6502_SWITCH, 0},
+   {"cached", V6502_CACHED, 0},
+   {"rewind", V6502_SWITCH, 1 << 24},
+   {"exact", V6502_EXACT, 0},
+};
+
+struct Device {
+   int reads, writes;
+};
+
+static void SpecialRead(Virtual_6502 *v, void *u)
+{
+   auto &dev = *(Device*)u;
+   // a key arrives every 16 polls
+   v->special_value = (!(++dev.reads & 15) && v->special_eai() == 0xC000) ? 0xC1 : 0x41;
+}
+
+static void SpecialWrite(Virtual_6502 *, void *u)
+{
+   auto &dev = *(Device*)u;
+   dev.writes++;
+}
+
+static Virtual_6502 *Load(const Workload &w, Device *dev, int engine = V6502_TABLE)
+{
+   Virtual_6502 *v = New6502(engine);
+   if (!v)
+   {
+      printf("Unable to allocate the virtual 6502\n");
+      exit(1);
+   }
+   memset(v->address_space, 0, 0xC000);
+   memcpy(v->address_space + 0x1000, w.code.data(), w.code.size());
+   v->special_start = v->address_space + 0xC000;
+   v->special_end = v->special_start + 0x100;
+   v->rom_start = v->address_space + 0xD000;
+   v->special_read = SpecialRead;
+   v->special_write = SpecialWrite;
+   v->special_user = dev;
+   *dev = {};
+   v->PC = 0x1000;
+   v->S = 0xFF;
+   v->P = 0x20;
+   SkipIdle6502(v, w.skip_idle);
+   return v;
+}
+
+int main(int argc, char *argv[])
+{
+   int const budget = argc > 1 ? atoi(argv[1]) : 20000000;
+   int const runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+   if (budget <= 0)
+   {
+      printf("usage: bench6502 [ticks [runs [workload...]]]\n");
+      return 1;
+   }
+   auto const selected = [&](const Workload &w) {
+      return argc <= 3 || std::any_of(argv + 3, argv + argc,
+                                      [&](const char *n){ return !strcmp(n, w.name); });
+   };
+
+   printf("%-10s %-8s %10s %12s %9s %9s %9s %9s %8s\n",
+          "workload", "engine", "cycles", "instructions", "cyc/disp", "ms", "MHz", "ns/instr", "io");
+   for (auto const &w : workloads)
+   {
+      if (!selected(w))
+         continue;
+      Device dev;
+
+      // count instructions by stepping
+      Virtual_6502 *v = Load(w, &dev);
+      long long cycles = 0, instructions = 0;
+      while (cycles < budget)
+      {
+         int const n = Execute6502(v, 1);
+         if (n <= 0)
+            break;
+         cycles += n;
+         instructions ++;
+      }
+      int const pc = v->PC;
+      Free6502(v);
+      if (cycles < budget)
+      {
+         printf("%-10s stopped at $%04X after %lld instructions\n", w.name, pc, instructions);
+         continue;
+      }
+
+      // time full speed runs, keep the fastest
+      for (auto const &e : engines)
+      {
+         double best = 0;
+         int io = 0;
+         for (int i = 0; i < runs; i++)
+         {
+            v = Load(w, &dev, e.engine);
+            Rewind6502(v, e.rewind);
+            auto const t0 = std::chrono::steady_clock::now();
+            int const n = Execute6502(v, budget);
+            auto const t1 = std::chrono::steady_clock::now();
+            double const s = std::chrono::duration<double>(t1 - t0).count();
+            if (!i || s < best)
+               best = s;
+            io = dev.reads + dev.writes;
+            Free6502(v);
+            if (n != cycles)
+               printf("%-10s %-8s executed %d ticks while stepping executed %lld\n",
+                      w.name, e.name, n, cycles);
+         }
+         char mhz[32] = "-", ns[32] = "-";
+         if (!w.skip_idle)
+         {
+            snprintf(mhz, sizeof mhz, "%.2f", cycles / best / 1e6);
+            snprintf(ns, sizeof ns, "%.3f", best * 1e9 / instructions);
+         }
+         printf("%-10s %-8s %10lld %12lld %9.3f %9.3f %9s %9s %8d\n",
+                w.name, e.name, cycles, instructions, (double)cycles / instructions,
+                best * 1e3, mhz, ns, io);
+      }
+   }
+
+   // batches of instances with the switch engine
+   enum { instances = 256 };
+   int const cores = std::max(1u, std::thread::hardware_concurrency());
+   printf("\n%-10s %8s %9s %10s %9s %9s %8s\n",
+          "workload", "threads", "instances", "cycles", "ms", "MHz", "speedup");
+   for (auto const &w : workloads)
+   {
+      if (!selected(w))
+         continue;
+      std::vector<Device> dev(instances);
+      std::vector<Batch6502> jobs(instances);
+      double single = 0;
+      for (int threads = 1; ; threads = std::min(threads * 2, cores))
+      {
+         Pool6502 *pool = NewPool6502(threads);
+         double best = 0;
+         long long cycles = 0;
+         for (int i = 0; i < runs; i++)
+         {
+            for (int j = 0; j < instances; j++)
+               jobs[j] = {Load(w, &dev[j], V6502_SWITCH), budget / instances, 0, V6502_BUDGET};
+            auto const t0 = std::chrono::steady_clock::now();
+            ExecuteBatch6502(pool, jobs.data(), instances);
+            auto const t1 = std::chrono::steady_clock::now();
+            double const s = std::chrono::duration<double>(t1 - t0).count();
+            if (!i || s < best)
+               best = s;
+            cycles = 0;
+            for (auto &j : jobs)
+            {
+               cycles += j.executed;
+               if (j.stop != V6502_BUDGET)
+                  printf("%-10s stopped at $%04X\n", w.name, j.v6502->PC);
+               Free6502(j.v6502);
+            }
+         }
+         FreePool6502(pool);
+         if (threads == 1)
+            single = best;
+         char mhz[32] = "-";
+         if (!w.skip_idle)
+            snprintf(mhz, sizeof mhz, "%.2f", cycles / best / 1e6);
+         printf("%-10s %8d %9d %10lld %9.3f %9s %8.2f\n",
+                w.name, threads, instances, cycles, best * 1e3, mhz, single / best);
+         if (threads == cores)
+            break;
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,279 @@
+// Conformance runner for the virtual 6502 core.
+//
+// Runs a test image, such as Klaus Dormann's 6502_functional_test.bin or
+// 6502_decimal_test.bin, with every interpreter engine and both CPU
+// variants. A test ends in a trap, a jump or branch to itself, or on an
+// illegal opcode; it passes when that is at the success address and the
+// error byte, if given, is zero. The engines sharing the timing of the
+// table engine run in slices, and their registers and cycle must match
+// the table engine's after every slice. The exact engine charges extra
+// ticks, so it is stepped along the table engine instead and must match
+// its registers after every instruction, with no fewer ticks. The engines
+// share their instruction handlers: comparing them catches faults in
+// dispatch, translation, journaling and timing, while a wrong handler only
+// shows when the image itself checks it. The Dormann images are NMOS
+// programs, not specifications of the 65C02.
+//
+// usage: conform6502 [-l load] [-s start] [-t success] [-e error]
+//                    [-c nmos|65c02] [-m ticks] image.bin
+//
+// Addresses are hex, -l defaults to 0 and -s to 400; one of -t and -e is
+// required. Without an image it exits with 77, which ctest reports as
+// skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "asm_6502.h"
+
+static const struct {
+   const char *name;
+   int engine;
+   int rewind;          // journal size, 0 for none
+} engines[] = {
+   {"table", V6502_TABLE, 0},
+   {"switch", V6502_SWITCH, 0},
+   {"cached", V6502_CACHED, 0},
+   {"rewind", V6502_SWITCH, 1 << 20},
+   {"exact", V6502_EXACT, 0},
+};
+
+static const struct {
+   const char *name;
+   int cpu;
+} cpus[] = {
+   {"nmos", V6502_NMOS},
+   {"65c02", V6502_65C02},
+};
+
+struct Options {
+   int load = 0, start = 0x400;
+   int success = -1, error = -1;     // -1 when not checked
+   const char *cpu = nullptr;        // both when NULL
+   long long ticks = 1000000000;     // give up after that many
+   std::vector<unsigned char> image;
+};
+
+struct State {
+   int PC, A, X, Y, S, P;
+   long long cycle;
+   bool ended;
+
+   explicit State(Virtual_6502 *v, bool ended = false) :
+      PC(v->PC), A(v->A), X(v->X), Y(v->Y), S(v->S), P(v->P), cycle(Cycle6502(v)), ended(ended) {}
+   bool sameRegisters(const State &o) const {
+      return PC == o.PC && A == o.A && X == o.X && Y == o.Y && S == o.S && P == o.P &&
+            ended == o.ended;
+   }
+   void print(const char *engine) const {
+      printf("   %-8s PC=$%04X A=$%02X X=$%02X Y=$%02X S=$%02X P=$%02X cycle %lld%s\n",
+             engine, PC, A, X, Y, S, P, cycle, ended ? " ended" : "");
+   }
+};
+
+static Virtual_6502 *Load(const Options &o, int engine, int cpu, int rewind)
+{
+   Virtual_6502 *v = New6502(engine, cpu);
+   if (!v)
+   {
+      printf("Unable to allocate the virtual 6502\n");
+      exit(1);
+   }
+   memset(v->address_space, 0, 0x10000);
+   memcpy(v->address_space + o.load, o.image.data(), o.image.size());
+   v->special_start = v->special_end = v->address_space;
+   v->rom_start = v->address_space + 0x10000;
+   v->PC = o.start;
+   v->S = 0xFF;
+   v->P = 0x24;
+   Rewind6502(v, rewind);
+   return v;
+}
+
+// executes one instruction; true when it was a trap or an illegal opcode,
+// left with PC at it
+static bool Step(Virtual_6502 *v)
+{
+   int const pc = v->PC;
+   Execute6502(v, 1);
+   if (v->stop == V6502_ILLEGAL)
+      v->PC = pc;
+   return v->PC == pc;
+}
+
+// executes at least ticks ticks, then one instruction to look for a trap
+static bool Slice(Virtual_6502 *v, int ticks)
+{
+   Execute6502(v, ticks);
+   if (v->stop == V6502_ILLEGAL)
+   {
+      v->PC = (v->PC - 1) & 0xFFFF;
+      return true;
+   }
+   return Step(v);
+}
+
+static bool Passed(Virtual_6502 *v, const Options &o)
+{
+   return (o.success < 0 || v->PC == o.success) && (o.error < 0 || !Peek6502(v, o.error));
+}
+
+static void Report(const char *cpu, const char *engine, Virtual_6502 *v, const Options &o)
+{
+   printf("%-6s %-8s %s at $%04X after %lld cycles", cpu, engine,
+          Passed(v, o) ? "passed" : "FAILED", v->PC, Cycle6502(v));
+   if (o.error >= 0)
+      printf(", error byte $%02X", Peek6502(v, o.error));
+   printf("\n");
+}
+
+// the engines timed as the table engine, compared slice by slice
+static bool RunSliced(const Options &o, const char *cpuName, int cpu)
+{
+   std::vector<Virtual_6502*> v;
+   std::vector<const char*> names;
+   for (auto const &e : engines)
+      if (e.engine != V6502_EXACT)
+      {
+         v.push_back(Load(o, e.engine, cpu, e.rewind));
+         names.push_back(e.name);
+      }
+   bool ok = true, ended = false;
+   while (ok && !ended)
+   {
+      std::vector<State> s;
+      for (auto *i : v)
+         s.emplace_back(i, Slice(i, 1 << 16));
+      for (size_t i = 1; i < v.size(); i++)
+         if (!s[i].sameRegisters(s[0]) || s[i].cycle != s[0].cycle)
+         {
+            printf("%-6s %-8s differs from %s:\n", cpuName, names[i], names[0]);
+            s[0].print(names[0]);
+            s[i].print(names[i]);
+            ok = false;
+            break;
+         }
+      ended = s[0].ended;
+      if (!ended && s[0].cycle > o.ticks)
+      {
+         printf("%-6s %-8s no trap within %lld cycles, PC=$%04X\n", cpuName, names[0], o.ticks, s[0].PC);
+         ok = false;
+      }
+   }
+   for (size_t i = 0; i < v.size(); i++)
+   {
+      if (ended)
+      {
+         Report(cpuName, names[i], v[i], o);
+         ok = ok && Passed(v[i], o);
+      }
+      Free6502(v[i]);
+   }
+   return ok;
+}
+
+// the exact engine, stepped along the table engine
+static bool RunExact(const Options &o, const char *cpuName, int cpu)
+{
+   Virtual_6502 *ref = Load(o, V6502_TABLE, cpu, 0);
+   Virtual_6502 *v = Load(o, V6502_EXACT, cpu, 0);
+   bool ok = true, ended = false;
+   for (long long n = 0; ok && !ended; n++)
+   {
+      int const pc = ref->PC;
+      State const r(ref, Step(ref)), s(v, Step(v));
+      if (!s.sameRegisters(r) || s.cycle < r.cycle)
+      {
+         printf("%-6s %-8s differs from table after instruction %lld at $%04X:\n", cpuName, "exact", n, pc);
+         r.print("table");
+         s.print("exact");
+         ok = false;
+      }
+      ended = r.ended;
+      if (!ended && r.cycle > o.ticks)
+      {
+         printf("%-6s %-8s no trap within %lld cycles, PC=$%04X\n", cpuName, "exact", o.ticks, r.PC);
+         ok = false;
+      }
+   }
+   if (ended)
+   {
+      Report(cpuName, "exact", v, o);
+      ok = ok && Passed(v, o);
+   }
+   Free6502(v);
+   Free6502(ref);
+   return ok;
+}
+
+static int Usage()
+{
+   printf("usage: conform6502 [-l load] [-s start] [-t success] [-e error]\n"
+          "                   [-c nmos|65c02] [-m ticks] image.bin\n");
+   return 2;
+}
+
+int main(int argc, char *argv[])
+{
+   Options o;
+   const char *path = nullptr;
+   for (int i = 1; i < argc; i++)
+   {
+      const char *const a = argv[i];
+      if (a[0] != '-' || !a[1])
+      {
+         path = a;
+         continue;
+      }
+      if (strlen(a) != 2 || i + 1 == argc)
+         return Usage();
+      const char *const value = argv[++i];
+      int const hex = (int)strtol(value, nullptr, 16);
+      switch (a[1])
+      {
+      case 'l': o.load = hex; break;
+      case 's': o.start = hex & 0xFFFF; break;
+      case 't': o.success = hex & 0xFFFF; break;
+      case 'e': o.error = hex & 0xFFFF; break;
+      case 'c': o.cpu = value; break;
+      case 'm': o.ticks = atoll(value); break;
+      default: return Usage();
+      }
+   }
+   if (!path || !*path)
+   {
+      printf("conform6502: no test image given, skipped\n");
+      return 77;
+   }
+   if (o.success < 0 && o.error < 0)
+      return Usage();
+
+   FILE *f = fopen(path, "rb");
+   if (!f)
+   {
+      printf("Unable to open %s\n", path);
+      return 1;
+   }
+   o.image.resize(0x10000 + 1);
+   o.image.resize(fread(o.image.data(), 1, o.image.size(), f));
+   fclose(f);
+   if (o.load < 0 || o.load + o.image.size() > 0x10000)
+   {
+      printf("%s does not fit in 64K at $%04X\n", path, o.load);
+      return 1;
+   }
+
+   bool ok = true, any = false;
+   for (auto const &c : cpus)
+   {
+      if (o.cpu && strcmp(o.cpu, c.name))
+         continue;
+      any = true;
+      ok = RunSliced(o, c.name, c.cpu) && ok;
+      ok = RunExact(o, c.name, c.cpu) && ok;
+   }
+   if (!any)
+      return Usage();
+   return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+// Saves state files over the file the instance was loaded from, whose image
+// it may have mapped as its memory, in every format, and checks that the
+// memory of the instance survives.
+//
+// usage: test_state6502 [path]
+
+#include <stdio.h>
+#include <string.h>
+#include "asm_6502.h"
+
+static int Expected(int addr)
+{
+   return (addr * 7) & 0xFF;
+}
+
+// true when the memory outside of the code page holds the pattern
+static bool Intact(Virtual_6502 *v)
+{
+   for (int addr = 0; addr < 0xC000; addr++)
+      if ((addr >> 8) != 0x10 && addr != 0x2000 && Peek6502(v, addr) != Expected(addr))
+      {
+         printf("$%04X holds $%02X instead of $%02X\n", addr, Peek6502(v, addr), Expected(addr));
+         return false;
+      }
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *const path = argc > 1 ? argv[1] : "test_state6502.state";
+   Virtual_6502 *v = New6502();
+   for (int addr = 0; addr < 0xC000; addr++)
+      v->address_space[addr] = Expected(addr);
+   static const unsigned char code[] = {
+      0xEE, 0x00, 0x20,       // 1000 INC $2000
+      0x4C, 0x00, 0x10,       // 1003 JMP $1000
+   };
+   memcpy(v->address_space + 0x1000, code, sizeof code);
+   v->PC = 0x1000;
+   bool ok = SaveFile6502(v, path);
+   Free6502(v);
+
+   // a full image is mapped when loaded: save it sparse, load that back,
+   // save it full and so on
+   static const int formats[] = {V6502_STATE_SPARSE, 0, V6502_STATE_SPARSE, 0};
+   for (int flags : formats)
+   {
+      if (!ok)
+         break;
+      v = LoadFile6502(path);
+      if (!v)
+      {
+         printf("Unable to load %s\n", path);
+         return 1;
+      }
+      ok = SaveFile6502(v, path, flags) && Intact(v);
+      Execute6502(v, 1000);
+      ok = ok && SaveFile6502(v, path, flags) && Intact(v);
+      Free6502(v);
+   }
+   remove(path);
+   printf("%s\n", ok ? "passed" : "FAILED");
+   return ok ? 0 : 1;
+}
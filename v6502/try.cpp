@@ -6,38 +6,38 @@
 #include "asm_6502.h"
 
 const char *dis[256] =
-{"BRK","ORAxi","?","?","?","ORAz","ASLz","?",
- "PHP","ORA#","ASLA","?","?","ORA$","ASL$","?",
- "BPLr","ORAiy","?","?","?","ORAzx","ASLzx","?",
- "CLC","ORAy","?","?","?","ORAx","ASLx","?",
- "JSR$","ANDxi","?","?","BITz","ANDz","ROLz","?",
- "PLP","AND#","ROLA","?","BIT$","AND$","ROL$","?",
- "BMIr","ANDiy","?","?","?","ANDzx","ROLzx","?",
- "SEC","ANDy","?","?","?","ANDx","ROLx","?",
- "RTI","EORxi","?","?","?","EORz","LSRz","?",
- "PHA","EOR#","LSRA","?","JMP$","EOR$","LSR$","?",
- "BVCr","EORiy","?","?","?","EORzx","LSRzx","?",
- "CLI","EORy","?","?","?","EORx","LSRx","?",
- "RTS","ADCxi","?","?","?","ADCz","RORz","?",
- "PLA","ADC#","RORA","?","JMPI","ADC$","ROR$","?",
- "BVSr","ADCiy","?","?","?","ADCzx","RORzx","?",
- "SEI","ADCy","?","?","?","ADCx","RORx","?",
- "?","STAxi","?","?","STYz","STAz","STXz","?",
- "DEY","?","TXA","?","STY$","STA$","STX$","?",
- "BCCr","STAiy","?","?","STYzx","STAzx","STXzy","?",
+{"BRK","ORAxi","?","SLOxi","NOPz","ORAz","ASLz","SLOz",
+ "PHP","ORA#","ASLA","ANC#","NOP$","ORA$","ASL$","SLO$",
+ "BPLr","ORAiy","?","SLOiy","NOPzx","ORAzx","ASLzx","SLOzx",
+ "CLC","ORAy","NOP","SLOy","NOPx","ORAx","ASLx","SLOx",
+ "JSR$","ANDxi","?","RLAxi","BITz","ANDz","ROLz","RLAz",
+ "PLP","AND#","ROLA","ANC#","BIT$","AND$","ROL$","RLA$",
+ "BMIr","ANDiy","?","RLAiy","NOPzx","ANDzx","ROLzx","RLAzx",
+ "SEC","ANDy","NOP","RLAy","NOPx","ANDx","ROLx","RLAx",
+ "RTI","EORxi","?","SRExi","NOPz","EORz","LSRz","SREz",
+ "PHA","EOR#","LSRA","ALR#","JMP$","EOR$","LSR$","SRE$",
+ "BVCr","EORiy","?","SREiy","NOPzx","EORzx","LSRzx","SREzx",
+ "CLI","EORy","NOP","SREy","NOPx","EORx","LSRx","SREx",
+ "RTS","ADCxi","?","RRAxi","NOPz","ADCz","RORz","RRAz",
+ "PLA","ADC#","RORA","ARR#","JMPI","ADC$","ROR$","RRA$",
+ "BVSr","ADCiy","?","RRAiy","NOPzx","ADCzx","RORzx","RRAzx",
+ "SEI","ADCy","NOP","RRAy","NOPx","ADCx","RORx","RRAx",
+ "NOP#","STAxi","NOP#","SAXxi","STYz","STAz","STXz","SAXz",
+ "DEY","NOP#","TXA","?","STY$","STA$","STX$","SAX$",
+ "BCCr","STAiy","?","?","STYzx","STAzx","STXzy","SAXzy",
  "TYA","STAy","TXS","?","?","STAx","?","?",
- "LDY#","LDAxi","LDX#","?","LDYz","LDAz","LDXz","?",
- "TAY","LDA#","TAX","?","LDY$","LDA$","LDX$","?",
- "BCSr","LDAiy","?","?","LDYzx","LDAzx","LDXzx","?",
- "CLV","LDAy","TSX","?","LDYx","LDAx","LDXy","?",
- "CPY#","CMPxi","?","?","CPYz","CMPz","DECz","?",
- "INY","CMP#","DEX","?","CPY$","CMP$","DEC$","?",
- "BNEr","CMPiy","?","?","?","CMPzx","DECzx","?",
- "CLD","CMPy","?","?","?","CMPx","DECx","?",
- "CPX#","SBCxi","?","?","CPXz","SBCz","INCz","?",
- "INX","SBC#","NOP","?","CPX$","SBC$","INC$","?",
- "BEQr","SBCiy","?","?","?","SBCzx","INCzx","?",
- "SED","SBCy","?","?","?","SBCx","INCx","?"};
+ "LDY#","LDAxi","LDX#","LAXxi","LDYz","LDAz","LDXz","LAXz",
+ "TAY","LDA#","TAX","?","LDY$","LDA$","LDX$","LAX$",
+ "BCSr","LDAiy","?","LAXiy","LDYzx","LDAzx","LDXzx","LAXzy",
+ "CLV","LDAy","TSX","?","LDYx","LDAx","LDXy","LAXy",
+ "CPY#","CMPxi","NOP#","DCPxi","CPYz","CMPz","DECz","DCPz",
+ "INY","CMP#","DEX","SBX#","CPY$","CMP$","DEC$","DCP$",
+ "BNEr","CMPiy","?","DCPiy","NOPzx","CMPzx","DECzx","DCPzx",
+ "CLD","CMPy","NOP","DCPy","NOPx","CMPx","DECx","DCPx",
+ "CPX#","SBCxi","NOP#","ISCxi","CPXz","SBCz","INCz","ISCz",
+ "INX","SBC#","NOP","SBC#","CPX$","SBC$","INC$","ISC$",
+ "BEQr","SBCiy","?","ISCiy","NOPzx","SBCzx","INCzx","ISCzx",
+ "SED","SBCy","NOP","ISCy","NOPx","SBCx","INCx","ISCx"};
 
 int Disasm(int pc,char *buffer,unsigned char *p)
 {
@@ -187,29 +187,17 @@ int main()
    int romsize;
    int speed=500000;
    int time,ot,wide=1;
+   int drawn_f=-1,drawn_wide=-1;
+   unsigned char dirty[32];
    int curchar = 0;
 
    Virtual_6502 *v6502;
-   v6502=New6502();
-
-   v6502->special_write=SpecialWrite;
-   v6502->special_read=SpecialRead;
-   v6502->special_start=v6502->address_space+0xC000;
-   v6502->special_end=v6502->special_start+0x0100;
-   v6502->special_user=&curchar;
-
-   if ((f=fopen("apple2.img","rb")) || (f=fopen("../v6502/apple2.img","rb")))
-   {
-      fread(&v6502->A,1,1,f);
-      fread(&v6502->X,1,1,f);
-      fread(&v6502->Y,1,1,f);
-      fread(&v6502->S,1,1,f);
-      fread(&v6502->P,1,2,f);
-      fread(v6502->address_space,256,256,f);
-      v6502->rom_start=v6502->address_space+0xC000;
-   }
-   else
+   if (!(v6502=LoadFile6502("apple2.state")) &&
+       !(v6502=LoadFile6502("../v6502/apple2.state")) &&
+       !(v6502=LoadFile6502("apple2.img")) &&
+       !(v6502=LoadFile6502("../v6502/apple2.img")))
    {
+      v6502=New6502();
       if (!(f=fopen("apple2.rom","rb")) && !(f=fopen("../v6502/apple2.rom","rb")))
       {
          printf("Unable to open rom image\n");
@@ -233,6 +221,15 @@ int main()
       v6502->PC=v6502->address_space[0xFFFC]+(v6502->address_space[0xFFFD]<<8);
    }
 
+   v6502->special_write=SpecialWrite;
+   v6502->special_read=SpecialRead;
+   v6502->special_start=v6502->address_space+0xC000;
+   v6502->special_end=v6502->special_start+0x0100;
+   v6502->special_user=&curchar;
+   // the keyboard only changes between Execute6502 calls, waiting for a
+   // key costs nothing
+   SkipIdle6502(v6502,true);
+
    {
       union REGS r;
       r.w.ax=0x01; int386(0x10,&r,&r);
@@ -308,36 +305,44 @@ int main()
 
          f=((*(char *)v_m(0x46C))&0x04)?0x7000:0x0700;
 
-         for (i=0; i<24; i++)
+         // redraw the text page when written, flashing or after a mode
+         // change only
+         DirtyPages6502(v6502,dirty);
+         if (dirty[0]&0xF0 || f!=drawn_f || wide!=drawn_wide)
          {
-            wp=(unsigned short *)B8000(i*(wide ? 80 : 160));
-            rp=v6502->address_space+
-                  (0x400+((i<<7)&0x0300)+
-                   (((i&0x18)+((i&1)<<7))|
-                    ((i&0x18)<<2)));
-            for (j=0; j<40; j++)
+            drawn_f=f;
+            drawn_wide=wide;
+            for (i=0; i<24; i++)
             {
-               int c;
-               c=rp[j];
-               if (c<32)
-               {
-                  *wp++=(c+64)|0x7000;
-               }
-               else if (c<64)
-               {
-                  *wp++=c|0x7000;
-               }
-               else if (c<96)
-               {
-                  *wp++=c|f;
-               }
-               else if (c<128)
-               {
-                  *wp++=(c-64)|f;
-               }
-               else
+               wp=(unsigned short *)B8000(i*(wide ? 80 : 160));
+               rp=v6502->address_space+
+                     (0x400+((i<<7)&0x0300)+
+                      (((i&0x18)+((i&1)<<7))|
+                       ((i&0x18)<<2)));
+               for (j=0; j<40; j++)
                {
-                  *wp++=(c-128)|0x0700;
+                  int c;
+                  c=rp[j];
+                  if (c<32)
+                  {
+                     *wp++=(c+64)|0x7000;
+                  }
+                  else if (c<64)
+                  {
+                     *wp++=c|0x7000;
+                  }
+                  else if (c<96)
+                  {
+                     *wp++=c|f;
+                  }
+                  else if (c<128)
+                  {
+                     *wp++=(c-64)|f;
+                  }
+                  else
+                  {
+                     *wp++=(c-128)|0x0700;
+                  }
                }
             }
          }
@@ -365,28 +370,19 @@ int main()
 
                printf("\ntime=%i\not=%i\n",time,ot);
             {
-               FILE *f;
-               if ((f=fopen("apple2.img","wb"))==NULL)
+               if (!SaveFile6502(v6502,"apple2.state"))
                {
-                  puts("Error creating image file");
+                  puts("Error creating state file");
                }
                else
                {
-                  fwrite(&v6502->A,1,1,f);
-                  fwrite(&v6502->X,1,1,f);
-                  fwrite(&v6502->Y,1,1,f);
-                  fwrite(&v6502->S,1,1,f);
-                  fwrite(&v6502->P,1,2,f);
-                  fwrite(v6502->address_space,256,256,f);
-                  fclose(f);
-                  puts("Image file saved");
+                  puts("State file saved");
                }
             }
                exit(1);
                break;
             case -60:
-               v6502->PC=v6502->address_space[0xFFFC]+
-                     (v6502->address_space[0xFFFD]<<8);
+               Reset6502(v6502);
                break;
             case -61:
                speed=-abs(speed);